@@ -69,27 +69,31 @@ class BrightnessPulseGenerator : public ThreadedCanvasManipulator {
 public:
   BrightnessPulseGenerator(RGBMatrix *m) : ThreadedCanvasManipulator(m), matrix_(m) {}
   void Run() {
-    const uint8_t max_brightness = matrix_->brightness();
+    // Dimming the output does not need to redraw anything, so we only
+    // fill when the color changes.
+    const uint8_t max_brightness = matrix_->output_brightness();
     const uint8_t c = 255;
     uint8_t count = 0;
+    matrix_->Fill(c, 0, 0);
 
     while (running()) {
-      if (matrix_->brightness() < 1) {
-        matrix_->SetBrightness(max_brightness);
+      if (matrix_->output_brightness() <= 1) {
+        matrix_->SetOutputBrightness(max_brightness);
         count++;
-      } else {
-        matrix_->SetBrightness(matrix_->brightness() - 1);
-      }
 
-      switch (count % 4) {
-        case 0: matrix_->Fill(c, 0, 0); break;
-        case 1: matrix_->Fill(0, c, 0); break;
-        case 2: matrix_->Fill(0, 0, c); break;
-        case 3: matrix_->Fill(c, c, c); break;
+        switch (count % 4) {
+          case 0: matrix_->Fill(c, 0, 0); break;
+          case 1: matrix_->Fill(0, c, 0); break;
+          case 2: matrix_->Fill(0, 0, c); break;
+          case 3: matrix_->Fill(c, c, c); break;
+        }
+      } else {
+        matrix_->SetOutputBrightness(matrix_->output_brightness() - 1);
       }
 
       usleep(20 * 1000);
     }
+    matrix_->SetOutputBrightness(max_brightness);
   }
 
 private:
@@ -282,11 +286,21 @@ public:
         usleep(100 * 1000);
         continue;
       }
-      for (int x = 0; x < screen_width; ++x) {
-        for (int y = 0; y < screen_height; ++y) {
-          const Pixel &p = current_image_.getPixel(
-                     (horizontal_position_ + x) % current_image_.width, y);
-          matrix_->transformer()->Transform(offscreen_)->SetPixel(x, y, p.red, p.green, p.blue);
+      Canvas *const canvas = matrix_->transformer()->Transform(offscreen_);
+      for (int y = 0; y < screen_height; ++y) {
+        if (y >= current_image_.height) {
+          canvas->DrawHLine(0, y, screen_width, 0, 0, 0);
+          continue;
+        }
+        // Copy the visible part of the image row (a Pixel is just the three
+        // rgb bytes); it might wrap around.
+        for (int x = 0; x < screen_width; /**/) {
+          const int src_x = (horizontal_position_ + x) % current_image_.width;
+          const int len = std::min(current_image_.width - src_x,
+                                   screen_width - x);
+          canvas->DrawSpan(x, y, len,
+                           &current_image_.getPixel(src_x, y).red);
+          x += len;
         }
       }
       offscreen_ = matrix_->SwapOnVSync(offscreen_);
@@ -1017,6 +1031,8 @@ static int usage(const char *progname) {
           "\t-c <chained>  : Daisy-chained boards. Default: 1.\n"
           "\t-L            : 'Large' display, composed out of 4 times 32x32\n"
           "\t-p <pwm-bits> : Bits used for PWM. Something between 1..11\n"
+          "\t-S <subframes>: Interleaved sub-frames per frame: 1, 2, 4, 8, "
+          "16. Default: 1\n"
           "\t-l            : Don't do luminance correction (CIE1931)\n"
           "\t-D <demo-nr>  : Always needs to be set\n"
           "\t-d            : run as daemon. Use this when starting in\n"
@@ -1025,7 +1041,14 @@ static int usage(const char *progname) {
           "\t-t <seconds>  : Run for these number of seconds, then exit.\n"
           "\t                (if neither -d nor -t are supplied, waits for <RETURN>)\n"
           "\t-b <brightnes>: Sets brightness percent. Default: 100.\n"
-          "\t-R <rotation> : Sets the rotation of matrix. Allowed: 0, 90, 180, 270. Default: 0.\n");
+          "\t-R <rotation> : Sets the rotation of matrix. Allowed: 0, 90, 180, 270. Default: 0.\n"
+          "\t-H <mapping>  : GPIO mapping: regular, adafruit-hat, "
+          "adafruit-hat-pwm,\n"
+          "\t                classic, classic-pi1. Default: %s\n"
+          "\t-i            : Inverse colors, for panels with inverse logic.\n"
+          "\t-s <slowdown> : GPIO slowdown for slow panels or long cables: "
+          "0..4.\n",
+          RGBMatrix::hardware_mapping());
   fprintf(stderr, "Demos, choosen with -D\n");
   fprintf(stderr, "\t0  - some rotating square\n"
           "\t1  - forward scrolling an image (-m <scroll-ms>)\n"
@@ -1054,6 +1077,7 @@ int main(int argc, char *argv[]) {
   int parallel = 1;
   int scroll_ms = 30;
   int pwm_bits = -1;
+  int subframes = 1;
   int brightness = 100;
   int rotation = 0;
   bool large_display = false;
@@ -1062,7 +1086,7 @@ int main(int argc, char *argv[]) {
   const char *demo_parameter = NULL;
 
   int opt;
-  while ((opt = getopt(argc, argv, "dlD:t:r:P:c:p:b:m:LR:")) != -1) {
+  while ((opt = getopt(argc, argv, "dlD:t:r:P:c:p:S:b:m:LR:H:is:")) != -1) {
     switch (opt) {
     case 'D':
       demo = atoi(optarg);
@@ -1096,6 +1120,10 @@ int main(int argc, char *argv[]) {
       pwm_bits = atoi(optarg);
       break;
 
+    case 'S':
+      subframes = atoi(optarg);
+      break;
+
     case 'b':
       brightness = atoi(optarg);
       break;
@@ -1115,6 +1143,24 @@ int main(int argc, char *argv[]) {
       rotation = atoi(optarg);
       break;
 
+    case 'H':
+      if (!RGBMatrix::SetHardwareMapping(optarg)) {
+        fprintf(stderr, "Unknown hardware mapping '%s'\n", optarg);
+        return usage(argv[0]);
+      }
+      break;
+
+    case 'i':
+      RGBMatrix::SetInverseColors(true);
+      break;
+
+    case 's':
+      if (!io.SetSlowdown(atoi(optarg))) {
+        fprintf(stderr, "GPIO slowdown outside usable range.\n");
+        return usage(argv[0]);
+      }
+      break;
+
     default: /* '?' */
       return usage(argv[0]);
     }
@@ -1184,6 +1230,10 @@ int main(int argc, char *argv[]) {
     fprintf(stderr, "Invalid range of pwm-bits\n");
     return 1;
   }
+  if (!matrix->SetSubframes(subframes)) {
+    fprintf(stderr, "Invalid number of sub-frames\n");
+    return 1;
+  }
 
   LinkedTransformer *transformer = new LinkedTransformer();
   matrix->SetTransformer(transformer);
@@ -1197,6 +1247,9 @@ int main(int argc, char *argv[]) {
     transformer->AddTransformer(new RotateTransformer(rotation));
   }
 
+  // Drawing is faster with the transformers flattened into a lookup table.
+  matrix->CompileTransformer();
+
   Canvas *canvas = matrix;
 
   // The ThreadedCanvasManipulator objects are filling
@@ -1280,6 +1333,15 @@ int main(int argc, char *argv[]) {
 
   // Stop image generating thread.
   delete image_gen;
+
+  RefreshStats stats;
+  matrix->GetStats(&stats);
+  if (stats.frames > 0) {
+    fprintf(stderr, "Refresh: %.1fHz average, p99 frame time %u usec, "
+            "%llu refreshes missed the deadline.\n",
+            1e6 * stats.frames / stats.total_usec, stats.p99_frame_usec,
+            (unsigned long long) stats.missed_deadlines);
+  }
   delete canvas;
 
   transformer->DeleteTransformers();
@@ -46,6 +46,33 @@ public:
 
   // Fill screen with given 24bpp color.
   virtual void Fill(uint8_t red, uint8_t green, uint8_t blue) = 0;
+
+  // Fill the "width" x "height" rectangle with the top left corner at
+  // "x", "y" with the given color. Parts outside the canvas are skipped.
+  //
+  // The default implementation calls SetPixel() for each pixel;
+  // implementations can do it much faster.
+  virtual void FillRect(int x, int y, int width, int height,
+                        uint8_t red, uint8_t green, uint8_t blue);
+
+  // Copy a "width" x "height" block of pixels to the top left corner at
+  // "x", "y". The "rgb" buffer contains three bytes per pixel (red, green,
+  // blue); "stride" is the number of bytes from one row to the next.
+  // Parts outside the canvas are skipped.
+  virtual void CopyRect(int x, int y, int width, int height,
+                        const uint8_t *rgb, int stride);
+
+  // Horizontal line of "width" pixels starting at "x", "y".
+  void DrawHLine(int x, int y, int width,
+                 uint8_t red, uint8_t green, uint8_t blue) {
+    FillRect(x, y, width, 1, red, green, blue);
+  }
+
+  // Horizontal run of "width" pixels starting at "x", "y", colored from
+  // "rgb" with three bytes per pixel.
+  void DrawSpan(int x, int y, int width, const uint8_t *rgb) {
+    CopyRect(x, y, width, 1, rgb, 3 * width);
+  }
 };
 
 // A canvas transformer is an object that, given a Canvas, returns a
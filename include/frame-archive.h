@@ -0,0 +1,95 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2015 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Archive of prerendered frames. Rendering an animation into FrameCanvases
+// can take a long time; store the result once with FrameArchiveWriter and
+// play it back any time with FrameArchive, which maps the file into memory
+// and shows the frames directly from there: no decoding, no copying, and
+// only the pages actually displayed are read from disk.
+//
+// Frames are stored in the internal format of the FrameCanvas, so an
+// archive can only be played back on a display with the same geometry.
+// The frames keep the PWM and dither bits they were recorded with,
+// whatever the display is set to.
+
+#ifndef RPI_FRAME_ARCHIVE_H
+#define RPI_FRAME_ARCHIVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "led-matrix.h"
+
+namespace rgb_matrix {
+class FrameArchiveWriter {
+public:
+  FrameArchiveWriter();
+  ~FrameArchiveWriter();  // Close()s if needed.
+
+  // Create the archive "filename". Returns false on failure.
+  bool Open(const char *filename);
+
+  // Add the content of "frame", which is to be shown for "delay_usec"
+  // microseconds. All frames need the same geometry and PWM bits.
+  bool AppendFrame(FrameCanvas *frame, uint32_t delay_usec);
+
+  // Finish writing. Only after this the archive can be read.
+  bool Close();
+
+private:
+  int fd_;
+  uint32_t geometry_[5];  // rows, columns, parallel, pwm and dither bits.
+  size_t frame_size_;
+  std::vector<uint32_t> delays_;
+};
+
+class FrameArchive {
+public:
+  FrameArchive();
+  ~FrameArchive();
+
+  // Map the archive "filename" for playback on frames like "like", usually
+  // created with RGBMatrix::CreateFrameCanvas(). Returns false if the file
+  // is not a valid archive or was made for a different geometry.
+  bool Open(const char *filename, FrameCanvas *like);
+
+  int frames() const { return canvases_.size(); }
+  uint32_t delay_usec(int i) const { return delays_[i]; }
+
+  // The FrameCanvas showing frame "i", to be passed to
+  // RGBMatrix::SwapOnVSync(). It remains owned by the FrameArchive, so
+  // the archive needs to stay around as long as its frames are in use.
+  //
+  // Drawing on it is allowed, but changes only this process' copy.
+  FrameCanvas *frame(int i);
+
+private:
+  void Unmap();
+
+  uint8_t *map_;
+  size_t map_size_;
+  int pwm_bits_;
+  int dither_bits_;
+  int rows_, columns_, parallel_;
+  uint8_t *first_frame_;
+  size_t frame_stride_;
+  const uint32_t *delays_;
+  std::vector<FrameCanvas*> canvases_;   // Created on first use.
+};
+}  // namespace rgb_matrix
+
+#endif  // RPI_FRAME_ARCHIVE_H
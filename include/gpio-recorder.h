@@ -0,0 +1,153 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2015 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Running the RGB matrix without hardware: record what would be sent to
+// the GPIO pins and decode it back into what the panels would show.
+//
+// Typical use:
+//   GPIORecorder recorder(1000000);
+//   GPIO io;
+//   io.Init(&recorder);
+//   RGBMatrix matrix(&io, 32, 1, 1);
+//   ... draw, SwapOnVSync() ...
+//   recorder.Reset();
+//   while (!recorder.full()) usleep(1000);
+//   std::vector<GPIORecorder::Event> events;
+//   recorder.GetEvents(&events);
+//   Hub75Decoder decoder(32, 1, 1);
+//   decoder.Replay(events);
+//   ... decoder.GetPixel(), decoder.frames(), decoder.frame_nanos() ...
+
+#ifndef RPI_GPIO_RECORDER_H
+#define RPI_GPIO_RECORDER_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include <vector>
+
+#include "gpio.h"
+#include "thread.h"
+
+namespace rgb_matrix {
+// A GPIOSink that records all writes with a timestamp.
+class GPIORecorder : public GPIOSink {
+public:
+  enum EventType {
+    SET_BITS,
+    CLEAR_BITS,
+    PULSE       // Bits cleared for "pulse_nanos"; followed by a SET_BITS.
+  };
+
+  struct Event {
+    int64_t time_nanos;   // Time since the recording started.
+    EventType type;
+    uint32_t bits;
+    long pulse_nanos;     // Requested length of a PULSE.
+  };
+
+  // Record up to "max_events" events. Later writes are dropped.
+  explicit GPIORecorder(size_t max_events);
+
+  // Discard all events recorded so far and start recording again.
+  void Reset();
+
+  // Returns true if "max_events" have been recorded.
+  bool full() const;
+
+  // Get a copy of the events recorded so far.
+  void GetEvents(std::vector<Event> *events) const;
+
+  // -- GPIOSink interface
+  virtual void SetBits(uint32_t value);
+  virtual void ClearBits(uint32_t value);
+  virtual void StartPulse(uint32_t bits, long nanos);
+
+private:
+  void Record(EventType type, uint32_t bits, long pulse_nanos);
+
+  const size_t max_events_;
+  mutable Mutex mutex_;
+  std::vector<Event> events_;
+  struct timespec start_;
+};
+
+// Replays recorded GPIO events as the HUB75 panels would see them: colors
+// are clocked into shift registers, latched by strobe and shown in the
+// addressed double-row during output-enable pulses. Reconstructs the image
+// and the timing of each row.
+class Hub75Decoder {
+public:
+  // Same geometry parameters as given to the RGBMatrix, and the number
+  // of sub-frames of a refresh (RGBMatrix::SetSubframes()).
+  Hub75Decoder(int rows, int chained_displays, int parallel_displays,
+               int subframes = 1);
+
+  // Replay "events". Only complete refresh cycles of the display count,
+  // i.e. one scan through all rows for each sub-frame; so the events should
+  // contain at least two of them.
+  //
+  // With dither bits, each refresh only shows one of the dither bitplanes.
+  // The colors are only exact if frames() is a multiple of 2^dither bits;
+  // "max_frames", if given, stops after that many frames.
+  void Replay(const std::vector<GPIORecorder::Event> &events,
+              int max_frames = 0);
+
+  int width() const { return columns_; }
+  int height() const { return rows_ * parallel_; }
+
+  // Number of complete frames (refreshes of all rows) replayed.
+  int frames() const { return frames_; }
+
+  // Average time of a frame in nanoseconds; 1e9 / frame_nanos() is the
+  // refresh rate.
+  int64_t frame_nanos() const;
+
+  // Perceived color of the pixel at "x", "y": the time each LED was on
+  // relative to the time it could have been on, scaled to 0..255. This is
+  // linear in light output, so luminance correction is not undone.
+  void GetPixel(int x, int y, uint8_t *red, uint8_t *green, uint8_t *blue) const;
+
+  // Time in nanoseconds the given color (0: red, 1: green, 2: blue) of the
+  // pixel was on over all frames. Based on the requested pulse lengths, so
+  // this is exact.
+  int64_t OnNanos(int x, int y, int color) const;
+
+  struct RowTiming {
+    int pulses;             // Number of output-enable pulses.
+    int64_t on_nanos;       // Sum of requested pulse lengths.
+    int64_t elapsed_nanos;  // Time from the first pulse of this row to the
+                            // first pulse of the next row.
+  };
+  // Timing of each double-row (0 .. rows/2 - 1), summed over all frames.
+  const RowTiming &row_timing(int double_row) const {
+    return row_timing_[double_row];
+  }
+
+private:
+  const int rows_;
+  const int columns_;
+  const int parallel_;
+  const int subframes_;
+
+  int frames_;
+  int64_t frames_elapsed_nanos_;
+  std::vector<int64_t> on_nanos_;   // [y][x][color]
+  std::vector<int64_t> max_nanos_;  // [double_row]: sum of all pulses.
+  std::vector<RowTiming> row_timing_;
+};
+}  // end namespace rgb_matrix
+
+#endif  // RPI_GPIO_RECORDER_H
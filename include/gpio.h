@@ -16,6 +16,7 @@
 #ifndef RPI_GPIO_H
 #define RPI_GPIO_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include <vector>
@@ -23,6 +24,22 @@
 // Putting this in our namespace to not collide with other things called like
 // this.
 namespace rgb_matrix {
+// Receives the output of a GPIO that is not connected to the hardware
+// registers, e.g. to record it or to run without a Raspberry Pi.
+// See GPIO::Init(GPIOSink*).
+class GPIOSink {
+public:
+  virtual ~GPIOSink() {}
+
+  // Set or clear the bits that are '1' in "value".
+  virtual void SetBits(uint32_t value) = 0;
+  virtual void ClearBits(uint32_t value) = 0;
+
+  // The PinPulser starts a pulse that keeps the "bits" cleared for
+  // "nanos" nanoseconds. The end of the pulse is a regular SetBits().
+  virtual void StartPulse(uint32_t bits, long /*nanos*/) { ClearBits(bits); }
+};
+
 // For now, everything is initialized as output.
 class GPIO {
  public:
@@ -35,32 +52,46 @@ class GPIO {
   // (e.g. due to a permission problem).
   bool Init();
 
+  // Initialize without hardware access: the output of the RGB matrix
+  // (and its PinPulser) written to this GPIO is sent to the "sink"
+  // instead. Does not take ownership. This works on any machine.
+  // Note, SetBits(), ClearBits() etc. called directly on this GPIO are
+  // not forwarded.
+  bool Init(GPIOSink *sink);
+
+  // The sink this GPIO was initialized with or NULL if it writes to
+  // the hardware.
+  GPIOSink *sink() const { return sink_; }
+
   // Initialize outputs.
   // Returns the bits that are actually set.
   uint32_t InitOutputs(uint32_t outputs);
 
+  // Set the bits that are '1' in "inputs" as inputs, e.g. pins that are
+  // wired to one of the outputs and must not drive against it.
+  void InitInputs(uint32_t inputs);
+
+  // Slow panels or long cables need the signals to stay on the pins longer:
+  // "slowdown" is how many times each write is repeated, 0..kMaxSlowdown.
+  // Default is RGB_SLOWDOWN_GPIO (see lib/Makefile) or 0. Can be changed
+  // at any time; the display refresh uses it from the next frame on.
+  // Returns false if out of range.
+  static const int kMaxSlowdown = 4;
+  bool SetSlowdown(int slowdown);
+  int slowdown() const { return __atomic_load_n(&slowdown_, __ATOMIC_RELAXED); }
+
   // Set the bits that are '1' in the output. Leave the rest untouched.
   inline void SetBits(uint32_t value) {
     if (!value) return;
     *gpio_set_bits_ = value;
-#ifdef RGB_SLOWDOWN_GPIO
-    *gpio_set_bits_ = value;
-#  if RGB_SLOWDOWN_GPIO > 1
-    *gpio_set_bits_ = value;   // for really slow cases
-#  endif
-#endif
+    for (int i = slowdown_; i > 0; --i) *gpio_set_bits_ = value;
   }
 
   // Clear the bits that are '1' in the output. Leave the rest untouched.
   inline void ClearBits(uint32_t value) {
     if (!value) return;
     *gpio_clr_bits_ = value;
-#ifdef RGB_SLOWDOWN_GPIO
-    *gpio_clr_bits_ = value;
-#  if RGB_SLOWDOWN_GPIO > 1
-    *gpio_clr_bits_ = value;  // for really slow cases
-#  endif
-#endif
+    for (int i = slowdown_; i > 0; --i) *gpio_clr_bits_ = value;
   }
 
   // Write all the bits of "value" mentioned in "mask". Leave the rest untouched.
@@ -71,15 +102,41 @@ class GPIO {
     SetBits(value & mask);
   }
 
+  // The same with the slowdown fixed at compile time, so that the repeated
+  // writes are unrolled. For loops that need every cycle: choose the
+  // instance matching slowdown() once outside of them.
+  template <int kSlowdown> inline void SetBits(uint32_t value) {
+    if (!value) return;
+    for (int i = 0; i <= kSlowdown; ++i) *gpio_set_bits_ = value;
+  }
+  template <int kSlowdown> inline void ClearBits(uint32_t value) {
+    if (!value) return;
+    for (int i = 0; i <= kSlowdown; ++i) *gpio_clr_bits_ = value;
+  }
+
   inline void Write(uint32_t value) { WriteMaskedBits(value, output_bits_); }
 
  private:
   uint32_t output_bits_;
+  int slowdown_;
+  GPIOSink *sink_;
   volatile uint32_t *gpio_port_;
   volatile uint32_t *gpio_set_bits_;
   volatile uint32_t *gpio_clr_bits_;
 };
 
+// Work that is done in small steps while a PinPulser waits for a long
+// pulse to end, so that the time is not spent idle.
+class IdleTask {
+public:
+  virtual ~IdleTask() {}
+
+  // Do some work, checking often enough that it returns before the
+  // microsecond counter (see internal::GetMicrosecondCounter()) reaches
+  // "deadline_usec". Returns false if there is nothing left to do.
+  virtual bool RunUntil(uint32_t deadline_usec) = 0;
+};
+
 // A PinPulser is a utility class that pulses a GPIO pin. There can be various
 // implementations.
 class PinPulser {
@@ -93,13 +150,27 @@ public:
   static PinPulser *Create(GPIO *io, uint32_t gpio_mask,
                            const std::vector<int> &nano_wait_spec);
 
+  PinPulser() : idle_task_(NULL) {}
   virtual ~PinPulser() {}
 
+  // Run "task" while WaitPulseFinished() waits for long pulses. Does not
+  // take ownership; NULL to switch off. Only to be called from the thread
+  // sending the pulses.
+  void SetIdleTask(IdleTask *task) { idle_task_ = task; }
+
   // Send a pulse with a given length (index into nano_wait_spec array).
   virtual void SendPulse(int time_spec_number) = 0;
 
   // If SendPulse() is asynchronously implemented, wait for pulse to finish.
   virtual void WaitPulseFinished() {}
+
+protected:
+  // Give the idle task the time until shortly before "end_usec", the
+  // microsecond counter value the current pulse ends at.
+  void RunIdleTask(uint32_t end_usec);
+
+private:
+  IdleTask *idle_task_;
 };
 
 }  // end namespace rgb_matrix
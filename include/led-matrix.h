@@ -32,6 +32,32 @@ namespace rgb_matrix {
 class FrameCanvas;   // Canvas for Double- and Multibuffering
 namespace internal { class Framebuffer; }
 
+// Statistics of the display refresh, see RGBMatrix::GetStats().
+// Counted since the refresh started or the last RGBMatrix::ResetStats().
+// All times are in microseconds.
+struct RefreshStats {
+  enum {
+    kRateBuckets  = 64,  // Histogram buckets ...
+    kRateBucketHz = 10   // ... each that many Hz wide. Last one: all above.
+  };
+
+  uint64_t frames;            // Number of refreshes of the full display.
+  uint64_t swaps;             // Number of new frames picked up.
+  uint64_t missed_deadlines;  // Refreshes longer than the deadline.
+
+  uint32_t max_frame_usec;    // Longest refresh.
+  uint32_t p99_frame_usec;    // 99% of the refreshes were at most this long.
+
+  // Where the time went.
+  uint64_t total_usec;
+  uint64_t clocking_usec;     // Clocking color data into the panels.
+  uint64_t waiting_usec;      // Waiting for output-enable pulses to finish.
+  uint64_t row_switch_usec;   // Row switching, strobe and all the rest.
+
+  // Number of refreshes by refresh rate.
+  uint32_t rate_histogram[kRateBuckets];
+};
+
 // The RGB matrix provides the framebuffer and the facilities to constantly
 // update the LED matrix.
 //
@@ -70,6 +96,19 @@ public:
   // Starts display refresh thread if this is the first setting.
   void SetGPIO(GPIO *io);
 
+  // Choose how the panels are wired to the GPIO pins, so that the same
+  // binary works with all of them: "regular", "adafruit-hat",
+  // "adafruit-hat-pwm", "classic" or "classic-pi1" (see lib/Makefile).
+  // The default is chosen at compile time.
+  // Has to be called before the first RGBMatrix gets its GPIO. Returns
+  // false for an unknown name or if it is too late.
+  static bool SetHardwareMapping(const char *name);
+  static const char *hardware_mapping();
+
+  // For panels that use inverse logic for the color bits. Like
+  // SetHardwareMapping(), only before the first RGBMatrix gets its GPIO.
+  static bool SetInverseColors(bool on);
+
   // Set PWM bits used for output. Default is 11, but if you only deal with
   // limited comic-colors, 1 might be sufficient. Lower require less CPU and
   // increases refresh-rate.
@@ -81,6 +120,19 @@ public:
   bool SetPWMBits(uint8_t value);
   uint8_t pwmbits();   // return the pwm-bits of the currently active buffer.
 
+  // Temporal dithering: with reduced PWM bits, keep "value" more bits and
+  // show them in turns in successive refreshes. The refresh rate stays
+  // almost that of the reduced PWM bits while the color depth in the
+  // average over several refreshes is that of both together, which avoids
+  // visible bands in gradients. PWM bits plus dither bits can be at most
+  // 11, e.g. SetPWMBits(7) and SetDitherBits(4). Default is 0.
+  //
+  // Returns boolean to signify if value was within range. Like
+  // SetPWMBits(), this applies to the active and future FrameCanvases; a
+  // later SetPWMBits() reduces the dither bits if needed.
+  bool SetDitherBits(uint8_t value);
+  uint8_t ditherbits();
+
   // Map brightness of output linearly to input with CIE1931 profile.
   void set_luminance_correct(bool on);
   bool luminance_correct() const;
@@ -90,6 +142,15 @@ public:
   void SetBrightness(uint8_t brightness);
   uint8_t brightness();
 
+  // Set brightness of the whole display in percent. 1%..100%.
+  // Unlike SetBrightness(), this scales the time the LEDs are on while
+  // refreshing, so it applies to everything shown right away, without
+  // redrawing and without losing color depth. Good for dimming ramps.
+  // At very low values, the shortest pulses can't be shortened further,
+  // so the least significant bits get relatively brighter.
+  void SetOutputBrightness(uint8_t brightness);
+  uint8_t output_brightness();
+
   //-- Double- and Multibuffering.
 
   // Create a new buffer to be used for multi-buffering. The returned new
@@ -104,6 +165,23 @@ public:
   // don't have to worry about deleting them.
   FrameCanvas *CreateFrameCanvas();
 
+  // Pool of FrameCanvases for programs that need temporary buffers, e.g.
+  // for playlists or transitions: acquire a cleared canvas, release it when
+  // done so that it can be used again. Unlike CreateFrameCanvas(), this
+  // does not grow memory use over time.
+  //
+  // ReserveFrameCanvases() makes sure "count" canvases are available in the
+  // pool up front, with all memory touched, so that acquiring them later
+  // neither allocates nor page-faults.
+  //
+  // Only release canvases that are not displayed or submitted anymore.
+  // ReleaseFrameCanvas() returns false and does nothing for a canvas that
+  // is still in use by the display, already released or not created by
+  // this matrix.
+  void ReserveFrameCanvases(int count);
+  FrameCanvas *AcquireFrameCanvas();
+  bool ReleaseFrameCanvas(FrameCanvas *canvas);
+
   // This method waits to the next VSync and swaps the active buffer with the
   // supplied buffer. The formerly active buffer is returned.
   //
@@ -111,14 +189,84 @@ public:
   // replaced with NULL. You can use the NULL-behavior to just wait on
   // VSync or to retrieve the initial buffer when preparing a multi-buffer
   // animation.
+  //
+  // Without GPIO set, nothing is displayed and this returns right away.
   FrameCanvas *SwapOnVSync(FrameCanvas *other);
 
+  // Like SwapOnVSync(), but the returned buffer gets a copy of the content
+  // of "other", so that drawing can continue incrementally on what is
+  // displayed instead of starting from the frame of two swaps ago.
+  FrameCanvas *SwapOnVSyncKeepContent(FrameCanvas *other);
+
+  // Non-blocking alternative to SwapOnVSync() for renderers that don't want
+  // to wait (triple buffering): publishes "other" as the newest frame,
+  // which is shown from the next VSync on, and immediately returns a
+  // frame that is not displayed and can be drawn on. If you submit faster
+  // than the display refreshes, frames that were never shown are handed
+  // back and the display always picks up the latest one.
+  //
+  // The first call creates the additional buffer needed. Don't mix with
+  // SwapOnVSync().
+  FrameCanvas *SubmitFrame(FrameCanvas *other);
+
+  // If enabled, frames passed to SwapOnVSync() are compiled into the exact
+  // sequence of GPIO writes needed to display them, which makes refreshing
+  // the display faster: this is visible as higher refresh rate on long
+  // chains. Costs memory for each compiled frame, and some time: with
+  // SwapOnVSync(), the refresh thread does most of the work while it waits
+  // for the long output-enable pulses of the current frame; if that is not
+  // enough, the call does the rest and the swap is one refresh later. With
+  // SubmitFrame(), it is done in the call.
+  //
+  // Drawing on a frame after it has been swapped in falls back to regular
+  // output for that frame until it is swapped in again.
+  void set_compile_frames(bool on) { compile_frames_ = on; }
+  bool compile_frames() const { return compile_frames_; }
+
+  // If enabled, the least significant PWM bits that are not used anywhere
+  // in a frame passed to SwapOnVSync() or SubmitFrame(), e.g. with palette
+  // content or images quantized to fewer bits, are not shown at all. This
+  // gives a higher refresh rate without losing colors.
+  void set_auto_pwm_bits(bool on) { auto_pwm_bits_ = on; }
+  bool auto_pwm_bits() const { return auto_pwm_bits_; }
+
+  // Get statistics of the display refresh. Counting is always on and
+  // cheap, so this can be used to monitor the refresh rate in the field.
+  void GetStats(RefreshStats *stats);
+  void ResetStats();
+
+  // Refreshes that take longer than this are counted as missed deadline
+  // in the RefreshStats. Default is 10000 usec, i.e. 100Hz refresh rate.
+  void SetRefreshDeadline(int usec);
+
+  // Show each frame as "count" interleaved sub-frames, a power of two up
+  // to 16. The long output-enable pulses of the high PWM bits are split
+  // into one shorter pulse per sub-frame, so each row lights up "count"
+  // times per frame, which reduces visible flicker, e.g. on camera, with
+  // long chains. This costs clocking in the high bitplanes "count" times.
+  // Returns false if "count" is not supported. Default: 1.
+  bool SetSubframes(int count);
+  int subframes() const { return subframes_; }
+
   // Set image transformer that maps the logical canvas we provide to the
   // physical canvas (e.g. panel mapping, rotation ...).
   // Does _not_ take ownership of the transformer.
   void SetTransformer(CanvasTransformer *transformer);
   inline CanvasTransformer *transformer() { return transformer_; }
 
+  // Flatten the current transformer, however many transformers it chains,
+  // into a table that maps each pixel directly to its place in the
+  // framebuffer. Setting pixels then only costs a table lookup.
+  //
+  // Afterwards, transformer() returns a transformer that uses the table for
+  // all FrameCanvases of this matrix. Call again if the mapping changes,
+  // e.g. the angle of a RotateTransformer; SetTransformer() discards the
+  // table.
+  //
+  // Returns false and leaves the transformer as-is if it maps a pixel to
+  // more than one pixel.
+  bool CompileTransformer();
+
   // -- Canvas interface. These write to the active FrameCanvas
   // (see documentation in canvas.h)
   virtual int width() const;
@@ -127,18 +275,28 @@ public:
                         uint8_t red, uint8_t green, uint8_t blue);
   virtual void Clear();
   virtual void Fill(uint8_t red, uint8_t green, uint8_t blue);
+  virtual void FillRect(int x, int y, int width, int height,
+                        uint8_t red, uint8_t green, uint8_t blue);
+  virtual void CopyRect(int x, int y, int width, int height,
+                        const uint8_t *rgb, int stride);
 
 private:
   class UpdateThread;
   friend class UpdateThread;
+  class CompiledTransformer;
 
   const int rows_;
   const int chained_displays_;
   const int parallel_displays_;
 
   uint8_t pwm_bits_;
+  uint8_t dither_bits_;
   bool do_luminance_correct_;
   uint8_t brightness_;
+  bool compile_frames_;
+  bool auto_pwm_bits_;
+  int refresh_deadline_usec_;
+  int subframes_;
 
   FrameCanvas *active_;
 
@@ -146,7 +304,9 @@ private:
   Mutex active_frame_sync_;
   UpdateThread *updater_;
   std::vector<FrameCanvas*> created_frames_;
+  std::vector<FrameCanvas*> free_frames_;   // Pool, see AcquireFrameCanvas()
   CanvasTransformer *transformer_;
+  CompiledTransformer *compiled_transformer_;
 };
 
 class FrameCanvas : public Canvas {
@@ -158,6 +318,37 @@ public:
   bool SetPWMBits(uint8_t value);
   uint8_t pwmbits();
 
+  // Temporal dithering bits for this Frame, see RGBMatrix::SetDitherBits().
+  bool SetDitherBits(uint8_t value);
+  uint8_t ditherbits();
+
+  // Keep a copy of the RGB values of all pixels of this Frame ("shadow
+  // buffer"), 3 bytes per pixel. With it,
+  //  - setting a pixel to the color it already has costs next to nothing,
+  //    which helps if mostly the same content is drawn again and again.
+  //  - GetPixel() can read back the color of a pixel.
+  //  - changing PWM bits, dither bits, brightness or luminance correction
+  //    re-encodes the content right away instead of needing a redraw.
+  // Enabling it clears the Frame.
+  void SetShadowBuffer(bool on);
+  bool has_shadow_buffer() const;
+
+  // Get the color of a pixel. Returns false if there is no shadow buffer
+  // or the pixel is outside the Frame.
+  bool GetPixel(int x, int y, uint8_t *red, uint8_t *green, uint8_t *blue);
+
+  // Copy the content of "other" into this Frame, e.g. to continue drawing
+  // incrementally on the buffer returned by SwapOnVSync(). Only the
+  // bitplanes in use are copied, which is much faster than drawing again;
+  // the PWM and dither bits, brightness and luminance correction are taken
+  // over as well. The shadow buffer is only kept if "other" has one, too.
+  // Returns false if "other" is from a matrix with a different geometry.
+  bool CopyFrom(const FrameCanvas &other);
+
+  // Copy only the rectangle that changed. Coordinates are those of the
+  // Frame, not of a transformer. Both need the same PWM and dither bits.
+  bool CopyFrom(const FrameCanvas &other, int x, int y, int width, int height);
+
   // Map brightness of output linearly to input with CIE1931 profile.
   void set_luminance_correct(bool on);
   bool luminance_correct() const;
@@ -172,9 +363,25 @@ public:
                         uint8_t red, uint8_t green, uint8_t blue);
   virtual void Clear();
   virtual void Fill(uint8_t red, uint8_t green, uint8_t blue);
+  virtual void FillRect(int x, int y, int width, int height,
+                        uint8_t red, uint8_t green, uint8_t blue);
+  virtual void CopyRect(int x, int y, int width, int height,
+                        const uint8_t *rgb, int stride);
+
+  // Set a block of "width" x "height" pixels with the top left corner at
+  // "x", "y". The "rgb" buffer contains three bytes per pixel (red, green,
+  // blue); "stride" is the number of bytes from one row to the next.
+  // Pixels outside the canvas are skipped. Same as CopyRect().
+  //
+  // This is much faster than calling SetPixel() for each pixel, so use
+  // this to upload full images or video frames.
+  void SetPixels(int x, int y, int width, int height,
+                 const uint8_t *rgb, int stride);
 
 private:
   friend class RGBMatrix;
+  friend class FrameArchive;
+  friend class FrameArchiveWriter;
 
   FrameCanvas(internal::Framebuffer *frame) : frame_(frame){}
   virtual ~FrameCanvas();
@@ -56,6 +56,7 @@ public:
   ~Mutex() { pthread_mutex_destroy(&mutex_); }
   void Lock() { pthread_mutex_lock(&mutex_); }
   void Unlock() { pthread_mutex_unlock(&mutex_); }
+  bool TryLock() { return pthread_mutex_trylock(&mutex_) == 0; }
   void WaitOn(pthread_cond_t *cond) { pthread_cond_wait(cond, &mutex_); }
 
 private:
@@ -20,6 +20,7 @@
 // $ make led-image-viewer
 
 #include "led-matrix.h"
+#include "frame-archive.h"
 #include "transformer.h"
 
 #include <math.h>
@@ -37,6 +38,8 @@ using rgb_matrix::Canvas;
 using rgb_matrix::FrameCanvas;
 using rgb_matrix::RGBMatrix;
 using rgb_matrix::CanvasTransformer;
+using rgb_matrix::FrameArchive;
+using rgb_matrix::FrameArchiveWriter;
 
 volatile bool interrupt_received = false;
 static void InterruptHandler(int signo) {
@@ -145,8 +148,36 @@ static void DisplayAnimation(const std::vector<PreprocessedFrame*> &frames,
   }
 }
 
+// Play frames from a prerendered archive. They are mapped on first use.
+static void DisplayArchive(FrameArchive *archive, RGBMatrix *matrix) {
+  signal(SIGTERM, InterruptHandler);
+  signal(SIGINT, InterruptHandler);
+  fprintf(stderr, "Display.\n");
+  for (unsigned int i = 0; !interrupt_received; ++i) {
+    const int frame = i % archive->frames();
+    matrix->SwapOnVSync(archive->frame(frame));
+    if (archive->frames() == 1) {
+      sleep(86400);  // Only one image. Nothing to do.
+    } else {
+      usleep(archive->delay_usec(frame));
+    }
+  }
+}
+
+static bool WriteArchive(const std::vector<PreprocessedFrame*> &frames,
+                         const char *filename) {
+  fprintf(stderr, "Write prerendered frames to %s\n", filename);
+  FrameArchiveWriter writer;
+  if (!writer.Open(filename)) return false;
+  for (size_t i = 0; i < frames.size(); ++i) {
+    if (!writer.AppendFrame(frames[i]->canvas(), frames[i]->delay_micros()))
+      return false;
+  }
+  return writer.Close();
+}
+
 static int usage(const char *progname) {
-  fprintf(stderr, "usage: %s [options] <image>\n", progname);
+  fprintf(stderr, "usage: %s [options] <image|archive>\n", progname);
   fprintf(stderr, "Options:\n"
           "\t-r <rows>     : Panel rows. '16' for 16x32 (1:8 multiplexing),\n"
 	  "\t                '32' for 32x32 (1:16), '8' for 1:4 multiplexing; "
@@ -155,7 +186,10 @@ static int usage(const char *progname) {
           "Default: 1\n"
           "\t-c <chained>  : Daisy-chained boards. Default: 1.\n"
           "\t-L            : Large 64x64 display made from four 32x32 in a chain\n"
-          "\t-d            : Run as daemon.\n");
+          "\t-d            : Run as daemon.\n"
+          "\t-O <archive>  : Only prerender the image into an archive file,\n"
+          "\t                which starts instantly when given as <archive>\n"
+          "\t                with the same display options.\n");
   return 1;
 }
 
@@ -168,15 +202,17 @@ int main(int argc, char *argv[]) {
   int pwm_bits = -1;
   bool large_display = false;  // example for using Transformers
   bool as_daemon = false;
+  const char *archive_output = NULL;
 
   int opt;
-  while ((opt = getopt(argc, argv, "r:P:c:p:dL")) != -1) {
+  while ((opt = getopt(argc, argv, "r:P:c:p:dLO:")) != -1) {
     switch (opt) {
     case 'r': rows = atoi(optarg); break;
     case 'P': parallel = atoi(optarg); break;
     case 'c': chain = atoi(optarg); break;
     case 'p': pwm_bits = atoi(optarg); break;
     case 'd': as_daemon = true; break;
+    case 'O': archive_output = optarg; break;
     case 'L':
       chain = 4;
       rows = 32;
@@ -213,14 +249,15 @@ int main(int argc, char *argv[]) {
   const char *filename = argv[optind];
 
   /*
-   * Set up GPIO pins. This fails when not running as root.
+   * Set up GPIO pins. This fails when not running as root. Not needed if
+   * we only write an archive.
    */
   GPIO io;
-  if (!io.Init())
+  if (archive_output == NULL && !io.Init())
     return 1;
 
   // Start daemon before we start any threads.
-  if (as_daemon) {
+  if (as_daemon && archive_output == NULL) {
     if (fork() != 0)
       return 0;
     close(STDIN_FILENO);
@@ -228,7 +265,8 @@ int main(int argc, char *argv[]) {
     close(STDERR_FILENO);
   }
 
-  RGBMatrix *const matrix = new RGBMatrix(&io, rows, chain, parallel);
+  // GPIO is set once the frames are ready.
+  RGBMatrix *const matrix = new RGBMatrix(NULL, rows, chain, parallel);
   if (pwm_bits >= 0 && !matrix->SetPWMBits(pwm_bits)) {
     fprintf(stderr, "Invalid range of pwm-bits\n");
     return 1;
@@ -242,16 +280,34 @@ int main(int argc, char *argv[]) {
     matrix->SetTransformer(new rgb_matrix::LargeSquare64x64Transformer());
   }
 
-  std::vector<Magick::Image> sequence_pics;
-  if (!LoadAnimation(filename, matrix->width(), matrix->height(),
-                     &sequence_pics)) {
-    return 0;
-  }
+  // A prerendered archive can be shown right away.
+  FrameArchive archive;
+  if (archive_output == NULL
+      && archive.Open(filename, matrix->SwapOnVSync(NULL))) {
+    fprintf(stderr, "Prerendered archive with %d frames.\n",
+            archive.frames());
+    matrix->SetGPIO(&io);
+    DisplayArchive(&archive, matrix);
+  } else {
+    std::vector<Magick::Image> sequence_pics;
+    if (!LoadAnimation(filename, matrix->width(), matrix->height(),
+                       &sequence_pics)) {
+      return 0;
+    }
 
-  std::vector<PreprocessedFrame*> frames;
-  PrepareBuffers(sequence_pics, matrix, &frames);
+    std::vector<PreprocessedFrame*> frames;
+    PrepareBuffers(sequence_pics, matrix, &frames);
 
-  DisplayAnimation(frames, matrix);
+    if (archive_output != NULL) {
+      const bool success = WriteArchive(frames, archive_output);
+      if (!success) fprintf(stderr, "Writing %s failed.\n", archive_output);
+      delete matrix;
+      return success ? 0 : 1;
+    }
+
+    matrix->SetGPIO(&io);
+    DisplayAnimation(frames, matrix);
+  }
 
   fprintf(stderr, "Caught signal. Exiting.\n");
 
@@ -116,9 +116,15 @@ int Font::DrawGlyph(Canvas *c, int x_pos, int y_pos, const Color &color,
     const rowbitmap_t row = g->bitmap[y];
     rowbitmap_t x_mask = 0x80000000;
     for (int x = 0; x < g->width; ++x, x_mask >>= 1) {
-      if (row & x_mask) {
-        c->SetPixel(x_pos + x, y_pos + y, color.r, color.g, color.b);
+      if ((row & x_mask) == 0) continue;
+      // Draw consecutive set bits as one line.
+      const int start = x;
+      while (x + 1 < g->width && (row & (x_mask >> 1))) {
+        ++x;
+        x_mask >>= 1;
       }
+      c->DrawHLine(x_pos + start, y_pos + y, x - start + 1,
+                   color.r, color.g, color.b);
     }
   }
   return g->width;
@@ -0,0 +1,47 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2015 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "canvas.h"
+
+namespace rgb_matrix {
+// Default implementations in terms of SetPixel(). We clip here, as some
+// canvases (e.g. the RotateTransformer) don't expect coordinates outside.
+void Canvas::FillRect(int x, int y, int w, int h,
+                      uint8_t red, uint8_t green, uint8_t blue) {
+  if (x < 0) { w += x; x = 0; }
+  if (y < 0) { h += y; y = 0; }
+  if (x + w > width()) w = width() - x;
+  if (y + h > height()) h = height() - y;
+  for (int row = y; row < y + h; ++row) {
+    for (int col = x; col < x + w; ++col) {
+      SetPixel(col, row, red, green, blue);
+    }
+  }
+}
+
+void Canvas::CopyRect(int x, int y, int w, int h,
+                      const uint8_t *rgb, int stride) {
+  if (x < 0) { rgb -= 3 * x; w += x; x = 0; }
+  if (y < 0) { rgb -= stride * y; h += y; y = 0; }
+  if (x + w > width()) w = width() - x;
+  if (y + h > height()) h = height() - y;
+  for (int row = y; row < y + h; ++row, rgb += stride) {
+    const uint8_t *pixel = rgb;
+    for (int col = x; col < x + w; ++col, pixel += 3) {
+      SetPixel(col, row, pixel[0], pixel[1], pixel[2]);
+    }
+  }
+}
+}  // namespace rgb_matrix
@@ -0,0 +1,223 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2015 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "frame-archive.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "framebuffer-internal.h"
+
+namespace rgb_matrix {
+namespace {
+// File layout. All numbers in host byte order, as archives are meant to be
+// made and played on the same kind of machine.
+//
+//   Header
+//   ... padding to kPageSize
+//   frame_count frames, each frame_stride bytes (frame_size, padded to
+//                                                kPageSize)
+//   frame_count uint32_t delays in microseconds.
+//
+// Frames are page aligned, so that each frame is mapped from its own
+// pages and showing a frame only needs its own pages in memory.
+static const char kMagic[8] = { 'R', 'G', 'B', 'F', 'R', 'A', 'M', 'E' };
+static const uint32_t kVersion = 2;  // 2: dither_bits
+static const size_t kPageSize = 4096;
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t encoding;       // Framebuffer::ContentEncoding()
+  uint32_t rows;
+  uint32_t columns;
+  uint32_t parallel;
+  uint32_t pwm_bits;
+  uint32_t frame_count;
+  uint32_t frame_size;
+  uint32_t frame_stride;
+  uint32_t frames_offset;
+  uint32_t delays_offset;
+  uint32_t dither_bits;    // Below the pwm_bits in the frames.
+};
+
+static size_t PageAlign(size_t size) {
+  return (size + kPageSize - 1) / kPageSize * kPageSize;
+}
+
+static bool WriteAt(int fd, off_t offset, const void *data, size_t len) {
+  const char *buffer = (const char*) data;
+  while (len > 0) {
+    const ssize_t w = pwrite(fd, buffer, len, offset);
+    if (w <= 0) return false;
+    buffer += w;
+    offset += w;
+    len -= w;
+  }
+  return true;
+}
+}  // anonymous namespace
+
+FrameArchiveWriter::FrameArchiveWriter() : fd_(-1), frame_size_(0) {}
+FrameArchiveWriter::~FrameArchiveWriter() { Close(); }
+
+bool FrameArchiveWriter::Open(const char *filename) {
+  Close();
+  fd_ = open(filename, O_CREAT|O_TRUNC|O_WRONLY, 0644);
+  delays_.clear();
+  return fd_ >= 0;
+}
+
+bool FrameArchiveWriter::AppendFrame(FrameCanvas *frame, uint32_t delay_usec) {
+  if (fd_ < 0) return false;
+  const internal::Framebuffer *const fb = frame->framebuffer();
+  const uint32_t geometry[5] = { (uint32_t) fb->rows(), (uint32_t) fb->width(),
+                                 (uint32_t) fb->parallel(),
+                                 frame->pwmbits(), frame->ditherbits() };
+  if (delays_.empty()) {
+    memcpy(geometry_, geometry, sizeof(geometry_));
+    frame_size_ = fb->content_size();
+  } else if (memcmp(geometry_, geometry, sizeof(geometry_)) != 0) {
+    return false;
+  }
+  const off_t offset = PageAlign(sizeof(Header))
+    + delays_.size() * PageAlign(frame_size_);
+  if (!WriteAt(fd_, offset, fb->content(), frame_size_))
+    return false;
+  delays_.push_back(delay_usec);
+  return true;
+}
+
+bool FrameArchiveWriter::Close() {
+  if (fd_ < 0) return true;
+  Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.encoding = internal::Framebuffer::ContentEncoding();
+  header.rows = geometry_[0];
+  header.columns = geometry_[1];
+  header.parallel = geometry_[2];
+  header.pwm_bits = geometry_[3];
+  header.dither_bits = geometry_[4];
+  header.frame_count = delays_.size();
+  header.frame_size = frame_size_;
+  header.frame_stride = PageAlign(frame_size_);
+  header.frames_offset = PageAlign(sizeof(Header));
+  header.delays_offset = (header.frames_offset
+                          + header.frame_count * header.frame_stride);
+  bool success = (!delays_.empty()
+                  && WriteAt(fd_, header.delays_offset, &delays_[0],
+                             delays_.size() * sizeof(uint32_t))
+                  && WriteAt(fd_, 0, &header, sizeof(header)));
+  if (close(fd_) != 0) success = false;
+  fd_ = -1;
+  return success;
+}
+
+FrameArchive::FrameArchive()
+  : map_(NULL), map_size_(0), pwm_bits_(0), dither_bits_(0), rows_(0),
+    columns_(0), parallel_(0), first_frame_(NULL), frame_stride_(0), delays_(NULL) {
+}
+
+FrameArchive::~FrameArchive() { Unmap(); }
+
+void FrameArchive::Unmap() {
+  for (size_t i = 0; i < canvases_.size(); ++i) {
+    delete canvases_[i];
+  }
+  canvases_.clear();
+  if (map_) munmap(map_, map_size_);
+  map_ = NULL;
+}
+
+bool FrameArchive::Open(const char *filename, FrameCanvas *like) {
+  Unmap();
+  const int fd = open(filename, O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(Header)) {
+    close(fd);
+    return false;
+  }
+  // Private mapping: frames can be drawn on without changing the file.
+  void *const map = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE,
+                         fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return false;
+  map_ = (uint8_t*) map;
+  map_size_ = st.st_size;
+
+  const Header *const header = (const Header*) map_;
+  const internal::Framebuffer *const fb = like->framebuffer();
+  if (memcmp(header->magic, kMagic, sizeof(kMagic)) != 0
+      || header->version != kVersion
+      || header->encoding != internal::Framebuffer::ContentEncoding()
+      || header->rows != (uint32_t) fb->rows()
+      || header->columns != (uint32_t) fb->width()
+      || header->parallel != (uint32_t) fb->parallel()
+      || header->pwm_bits < 1
+      || header->pwm_bits > internal::Framebuffer::kMaxBitPlanes
+      || header->dither_bits > (internal::Framebuffer::kMaxBitPlanes
+                                - header->pwm_bits)
+      || header->frame_count < 1
+      || header->frames_offset < PageAlign(sizeof(Header))
+      || header->frames_offset % kPageSize != 0
+      || header->frame_stride % kPageSize != 0
+      || header->frame_stride < header->frame_size
+      || header->delays_offset < (header->frames_offset
+                                  + (uint64_t) header->frame_count
+                                  * header->frame_stride)
+      || map_size_ < (header->delays_offset
+                      + (uint64_t) header->frame_count * sizeof(uint32_t))) {
+    Unmap();
+    return false;
+  }
+
+  // We need a frame to know how large the content for this geometry is.
+  internal::Framebuffer probe(header->rows, header->columns, header->parallel);
+  if (!probe.SetPWMBits(header->pwm_bits)
+      || !probe.SetDitherBits(header->dither_bits)
+      || probe.content_size() != header->frame_size) {
+    Unmap();
+    return false;
+  }
+
+  pwm_bits_ = header->pwm_bits;
+  dither_bits_ = header->dither_bits;
+  rows_ = header->rows;
+  columns_ = header->columns;
+  parallel_ = header->parallel;
+  first_frame_ = map_ + header->frames_offset;
+  frame_stride_ = header->frame_stride;
+  delays_ = (const uint32_t*) (map_ + header->delays_offset);
+  canvases_.resize(header->frame_count, NULL);
+  return true;
+}
+
+FrameCanvas *FrameArchive::frame(int i) {
+  if (i < 0 || i >= frames()) return NULL;
+  if (canvases_[i] == NULL) {
+    canvases_[i] = new FrameCanvas(
+      new internal::Framebuffer(rows_, columns_, parallel_,
+                                pwm_bits_, dither_bits_,
+                                first_frame_ + i * frame_stride_));
+  }
+  return canvases_[i];
+}
+}  // namespace rgb_matrix
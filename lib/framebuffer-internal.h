@@ -15,10 +15,14 @@
 #ifndef RPI_RGBMATRIX_FRAMEBUFFER_INTERNAL_H
 #define RPI_RGBMATRIX_FRAMEBUFFER_INTERNAL_H
 
+#include <stddef.h>
 #include <stdint.h>
 
+#include <vector>
+
 namespace rgb_matrix {
 class GPIO;
+class IdleTask;
 class PinPulser;
 namespace internal {
 // Internal representation of the frame-buffer that as well can
@@ -27,200 +31,473 @@ namespace internal {
 // written out.
 class Framebuffer {
 public:
-  Framebuffer(int rows, int columns, int parallel);
+  enum {
+    kMaxBitPlanes = 11  // pwm_bits + dither_bits at most.
+  };
+
+  // Only the bitplanes for "pwm_bits" and "dither_bits" are allocated.
+  // With "external_data", nothing is: it is shown as with
+  // SetExternalContent().
+  Framebuffer(int rows, int columns, int parallel,
+              int pwm_bits = 11, int dither_bits = 0,
+              uint8_t *external_data = NULL);
   ~Framebuffer();
 
   // Initialize GPIO bits for output. Only call once.
   static void InitGPIO(GPIO *io, int parallel);
 
+  // Run "task" while DumpToMatrix() waits for long output-enable pulses,
+  // see PinPulser::SetIdleTask(). Only call from the thread refreshing
+  // the display, after InitGPIO().
+  static void SetIdleTask(IdleTask *task);
+
+  // The GPIO bits used for each of the signals sent to the panels. Useful to
+  // interpret recorded output.
+  struct Signals {
+    uint32_t clock;
+    uint32_t strobe;
+    uint32_t output_enable;
+    uint32_t row_address[4];  // a, b, c, d
+    uint32_t color[3][2][3];  // [parallel chain][upper, lower][red, green, blue]
+    bool inverse_colors;      // If color bits are low for 'on'.
+  };
+  static void GetSignals(Signals *signals);
+
+  // The wiring of the panels to the GPIO pins: "regular", "adafruit-hat",
+  // "adafruit-hat-pwm", "classic" or "classic-pi1". The default is chosen at
+  // compile time. Returns false for an unknown name or after InitGPIO().
+  static bool SetHardwareMapping(const char *name);
+  static const char *hardware_mapping();
+
+  // For panels that use inverse logic for the color bits. The content is
+  // the same, only the output differs. Default is chosen at compile time.
+  // Returns false after InitGPIO().
+  static bool SetInverseColors(bool on);
+  static bool inverse_colors();
+
   // Set PWM bits used for output. Default is 11, but if you only deal with
   // simple comic-colors, 1 might be sufficient. Lower require less CPU.
   // Returns boolean to signify if value was within range.
+  //
+  // Only the bitplanes in use are allocated, so changing this reallocates
+  // them. As the old ones might still be displayed at that moment, they
+  // are only deleted in FreeRetiredPlanes().
   bool SetPWMBits(uint8_t value);
-  uint8_t pwmbits() { return pwm_bits_; }
+  uint8_t pwmbits() { return planes_->count - planes_->dither; }
+
+  // Temporal dithering: keep "value" more bits below the PWM bits, which
+  // are shown in turns, one in each refresh, so that they are there in the
+  // average over successive refreshes. Only costs clocking in one
+  // additional bitplane per refresh. PWM bits and dither bits together
+  // can be at most 11. Returns boolean to signify if value was in range.
+  bool SetDitherBits(uint8_t value);
+  uint8_t ditherbits() { return planes_->dither; }
+
+  // Delete bitplanes replaced by SetPWMBits(). Only call when this frame
+  // is not being displayed or a full refresh happened since. Frames that
+  // have never been displayed don't keep them in the first place.
+  void FreeRetiredPlanes();
 
   // Map brightness of output linearly to input with CIE1931 profile.
-  void set_luminance_correct(bool on) { do_luminance_correct_ = on; }
+  void set_luminance_correct(bool on);
   bool luminance_correct() const { return do_luminance_correct_; }
 
   // Set brightness in percent; range=1..100
   // This will only affect newly set pixels.
-  void SetBrightness(uint8_t b) {
-    brightness_ = (b <= 100 ? (b != 0 ? b : 1) : 100);
-  }
+  void SetBrightness(uint8_t b);
   uint8_t brightness() { return brightness_; }
 
-  void DumpToMatrix(GPIO *io);
+  // Brightness in percent (1..100) of the output of all frames, applied
+  // by shortening the output-enable pulses. Takes effect with the next
+  // refresh; the content is not touched.
+  static void SetOutputBrightness(uint8_t percent);
+  static uint8_t output_brightness();
+
+  // Time spent in DumpToMatrix() in microseconds.
+  struct DumpTiming {
+    uint32_t clocking;  // Clocking in the color data.
+    uint32_t waiting;   // Waiting for output-enable pulses to finish.
+  };
+
+  // Send the frame to the matrix. If "timing" is not NULL, adds the time
+  // spent to it.
+  // The frame is sent as "subframes" interleaved sub-frames, a power of
+  // two up to kMaxSubframes, each with a share of the longer bitplanes.
+  void DumpToMatrix(GPIO *io, DumpTiming *timing = NULL, int subframes = 1);
+  static const int kMaxSubframes = 16;
+
+  // Translate the current content once into the sequence of GPIO clear and
+  // set words DumpToMatrix() has to send, so that refreshing the display
+  // does not need to compute them again and again. Any later change of the
+  // content or PWM bits discards the compiled output until Compile() is
+  // called again; in the meantime, the regular output is used.
+  void Compile();
+
+  // Like Compile(), but in steps: returns when the microsecond counter (see
+  // GetMicrosecondCounter()) reaches "deadline_usec", and the next call
+  // continues where this one stopped. Returns true when done.
+  // Does not allocate memory: needs ReserveCompiled() first, otherwise
+  // nothing is done.
+  bool CompileUntil(uint32_t deadline_usec);
+  void ReserveCompiled();
+
+  // Analyze the content for shortcuts DumpToMatrix() can take: rows of
+  // bitplanes that are identical to the same row of the bitplane before,
+  // which is what the panels have in their shift registers at that point,
+  // are only latched again. Typical for saturated colors.
+  // With "skip_blank_planes", the least significant bitplanes that are all
+  // black, e.g. for palette content, are not shown at all.
+  // Only looks at the content if it changed since the last call.
+  void Analyze(bool skip_blank_planes);
 
   // Canvas-inspired methods, but we're not implementing this interface to not
   // have an unnecessary vtable.
   inline int width() const { return columns_; }
   inline int height() const { return height_; }
+  inline int rows() const { return rows_; }
+  inline int parallel() const { return parallel_; }
+
+  // The raw content: the bitplanes in use including the dither bits,
+  // content_size() bytes. Used to store prerendered frames.
+  size_t content_size() const { return planes_->count * plane_size(); }
+  const uint8_t *content() const { return planes_->data; }
+
+  // Display "data" that has been retrieved with content() from a frame with
+  // the same geometry, "pwm_bits" and "dither_bits". The memory is not
+  // copied, so it must stay valid as long as it is used here. Like
+  // SetPWMBits(), this retires the previous content.
+  void SetExternalContent(int pwm_bits, int dither_bits, uint8_t *data);
+
+  // Copy the content of "other", which needs to have the same geometry,
+  // with its PWM and dither bits. Only the bitplanes in use are copied.
+  // The shadow buffer is only kept if "other" has one as well.
+  // Returns false if the geometry differs.
+  bool CopyFrom(const Framebuffer &other);
+  // Copy only the given rectangle; the PWM and dither bits have to be the
+  // same already.
+  bool CopyFrom(const Framebuffer &other, int x, int y, int width, int height);
+
+  // Identifies how content() is encoded; content can only be exchanged
+  // between builds with the same encoding.
+  static uint32_t ContentEncoding();
   void SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue);
+
+  // The position of pixel "x", "y" in our internal layout. Can be
+  // precomputed to set pixels with SetPixelAt() without further coordinate
+  // calculations. Positions are the same for all Framebuffers with the same
+  // geometry. Returns kInvalidPixelPosition if outside the frame.
+  static const uint32_t kInvalidPixelPosition = 0xffffffff;
+  uint32_t PixelPosition(int x, int y) const;
+  void SetPixelAt(uint32_t position, uint8_t red, uint8_t green, uint8_t blue);
+
+  // Set a "width" x "height" block of pixels starting at "x", "y" from
+  // "rgb", which holds three bytes (red, green, blue) per pixel with
+  // "stride" bytes from one row to the next.
+  void SetPixels(int x, int y, int width, int height,
+                 const uint8_t *rgb, int stride);
+  void FillRect(int x, int y, int width, int height,
+                uint8_t red, uint8_t green, uint8_t blue);
   void Clear();
   void Fill(uint8_t red, uint8_t green, uint8_t blue);
 
+  // Optionally keep a copy of the RGB values of all pixels, the shadow
+  // buffer. Setting a pixel to the color it already has then does not
+  // touch the bitplanes, the color of a pixel can be read back and
+  // changing brightness, luminance correction, PWM or dither bits
+  // re-encodes the frame. Enabling clears the frame.
+  void SetShadowBuffer(bool on);
+  bool has_shadow_buffer() const { return shadow_ != NULL; }
+  // Returns false if outside the frame or there is no shadow buffer.
+  bool GetPixel(int x, int y,
+                uint8_t *red, uint8_t *green, uint8_t *blue) const;
+
 private:
-  // Map color
-  inline uint16_t MapColor(uint8_t c);
+  // The bits of a color in each bitplane: bits 0, 1, 2 for red, green and
+  // blue; shifted by 3 for the lower sub-panel. The words are there to
+  // combine all bitplanes at once.
+  union PlaneBits {
+    uint8_t plane[16];   // Indexed by bitplane.
+    uint64_t words[2];
+  };
+  // Lookup table of the PlaneBits of the 256 values of red, green and blue
+  // for the given settings. Built on first use, shared by all frames.
+  static const PlaneBits *ColorLUT(bool luminance_correct, uint8_t brightness);
+  inline PlaneBits MapColor(uint8_t red, uint8_t green, uint8_t blue) const;
+
+  // Mask of the bits we need to set while clocking in.
+  uint32_t ColorClockMask() const;
+
+  // DumpToMatrix() for any "IO" providing SetBits(), ClearBits() and
+  // WriteMaskedBits().
+  template <class IO> void DumpToMatrixImpl(IO *io, DumpTiming *timing,
+                                            int subframes);
 
   const int rows_;     // Number of rows. 16 or 32.
   const int parallel_; // Parallel rows of chains. 1 or 2.
   const int height_;   // rows * parallel
   const int columns_;  // Number of columns. Number of chained boards * 32.
 
-  uint8_t pwm_bits_;   // PWM bits to display.
   bool do_luminance_correct_;
   uint8_t brightness_;
+  const PlaneBits *color_lut_;  // For the settings above.
 
   const int double_rows_;
   const uint8_t row_mask_;
 
-#if defined(ADAFRUIT_RGBMATRIX_HAT) || defined(ADAFRUIT_RGBMATRIX_HAT_PWM)
+  // The supported GPIO mappings, see SetHardwareMapping(). Each has an
+  // IoBits union that reflects its mapping. The naming of the pins of type
+  // 'p0_r1' means 'first parallel chain, red-bit one'.
+  // They are only used to get the Signals of the mapping in use, which is
+  // what all output is done with.
+
+  // Standard pinout since July 2015
+  // This uses the PWM pin to create the timing.
+  struct RegularPinout {
+    union IoBits {
+      struct {
+        //                                 GPIO Header-pos
+        unsigned int unused_0_1     : 2;  //  0..1  (only on RPi 1, Revision 1)
+        unsigned int p2_g1          : 1;  //  2 P1-03 (masks SDA when parallel=3)
+        unsigned int p2_b1          : 1;  //  3 P1-05 (masks SCL when parallel=3)
+        unsigned int strobe         : 1;  //  4 P1-07
+        unsigned int p1_g1          : 1;  //  5 P1-29 (only on A+/B+/Pi2)
+        unsigned int p1_b1          : 1;  //  6 P1-31 (only on A+/B+/Pi2)
+        // TODO: be able to disable chain 0 for higher-pin RPis to gain SPI back.
+        unsigned int p0_b1          : 1;  //  7 P1-26 (masks: SPI0_CE1)
+        unsigned int p0_r2          : 1;  //  8 P1-24 (masks: SPI0_CE0)
+        unsigned int p0_g2          : 1;  //  9 P1-21 (masks: SPI0_MISO
+        unsigned int p0_b2          : 1;  // 10 P1-19 (masks: SPI0_MOSI)
+        unsigned int p0_r1          : 1;  // 11 P1-23 (masks: SPI0_SCKL)
+
+        unsigned int p1_r1          : 1;  // 12 P1-32 (only on A+/B+/Pi2)
+        unsigned int p1_g2          : 1;  // 13 P1-33 (only on A+/B+/Pi2)
+        unsigned int p2_r1          : 1;  // 14 P1-08 (masks TxD when parallel=3)
+        unsigned int unused_15      : 1;  // 15 P1-10 (RxD) - kept free.
+        unsigned int p2_g2          : 1;  // 16 P1-36 (only on A+/B+/Pi2)
+
+        unsigned int clock          : 1;  // 17 P1-11
+
+        unsigned int output_enable  : 1;  // 18 P1-12 (PWM pin: our timing)
+        unsigned int p1_r2          : 1;  // 19 P1-35 (only on A+/B+/Pi2)
+        unsigned int p1_b2          : 1;  // 20 P1-38 (only on A+/B+/Pi2)
+        unsigned int p2_b2          : 1;  // 21 P1-40 (only on A+/B+/Pi2)
+
+        unsigned int a              : 1;  // 22 P1-15  // row bits.
+        unsigned int b              : 1;  // 23 P1-16
+        unsigned int c              : 1;  // 24 P1-18
+        unsigned int d              : 1;  // 25 P1-22
+
+        unsigned int p2_r2          : 1;  // 26 P1-37 (only on A+/B+/Pi2)
+        unsigned int p0_g1          : 1;  // 27 P1-13 (Not on RPi1, Rev1)
+      } bits;
+      uint32_t raw;
+      IoBits() : raw(0) {}
+    };
+  };
+
   // Adafruit made a HAT to work with this library, but it has a slightly
-  // different GPIO mapping. This is this mapping. A variant of this mapping
-  // allows using the Raspberry Pi PWM hardware. This requires modifying the
-  // HAT to connect GPIO 4 and 18. See #else for regular mapping.
-  union IoBits {
-    struct {
-      // This bitset reflects the GPIO mapping. The naming of the
-      // pins of type 'p0_r1' means 'first parallel chain, red-bit one'
-      unsigned int unused_0_3         : 4;  // 0..3
-#ifdef ADAFRUIT_RGBMATRIX_HAT_PWM      
-      unsigned int unused_4           : 1;  // 4
-#else
-      unsigned int output_enable      : 1;  // 4
-#endif
-      unsigned int p0_r1              : 1;  // 5
-      unsigned int p0_b1              : 1;  // 6
-      unsigned int unused_7_11        : 5;  // 7..11
-      unsigned int p0_r2              : 1;  // 12
-      unsigned int p0_g1              : 1;  // 13
-      unsigned int unused_14_15       : 2;  // 14,15
-      unsigned int p0_g2              : 1;  // 16
-      unsigned int clock              : 1;  // 17
-#ifdef ADAFRUIT_RGBMATRIX_HAT_PWM      
-      unsigned int output_enable      : 1;  // 18
-      unsigned int unused_19          : 1;  // 19
-#else
-      unsigned int unused_18_19       : 2;  // 18,19
-#endif
-      unsigned int d                  : 1;  // 20
-      unsigned int strobe             : 1;  // 21
-      unsigned int a                  : 1;  // 22
-      unsigned int p0_b2              : 1;  // 23
-      unsigned int unused_24_25       : 2;  // 24,25
-      unsigned int b                  : 1;  // 26
-      unsigned int c                  : 1;  // 27
-    } bits;
-    uint32_t raw;
-    IoBits() : raw(0) {}
+  // different GPIO mapping. It only supports one chain.
+  struct AdafruitHatPinout {
+    union IoBits {
+      struct {
+        unsigned int unused_0_3         : 4;  // 0..3
+        unsigned int output_enable      : 1;  // 4
+        unsigned int p0_r1              : 1;  // 5
+        unsigned int p0_b1              : 1;  // 6
+        unsigned int unused_7_11        : 5;  // 7..11
+        unsigned int p0_r2              : 1;  // 12
+        unsigned int p0_g1              : 1;  // 13
+        unsigned int unused_14_15       : 2;  // 14,15
+        unsigned int p0_g2              : 1;  // 16
+        unsigned int clock              : 1;  // 17
+        unsigned int unused_18_19       : 2;  // 18,19
+        unsigned int d                  : 1;  // 20
+        unsigned int strobe             : 1;  // 21
+        unsigned int a                  : 1;  // 22
+        unsigned int p0_b2              : 1;  // 23
+        unsigned int unused_24_25       : 2;  // 24,25
+        unsigned int b                  : 1;  // 26
+        unsigned int c                  : 1;  // 27
+      } bits;
+      uint32_t raw;
+      IoBits() : raw(0) {}
+    };
   };
-#elif defined(RGB_CLASSIC_PINOUT)
+
+  // A variant of the Adafruit HAT mapping that allows using the Raspberry
+  // Pi PWM hardware. This requires modifying the HAT to connect GPIO 4
+  // and 18.
+  struct AdafruitHatPwmPinout {
+    union IoBits {
+      struct {
+        unsigned int unused_0_3         : 4;  // 0..3
+        unsigned int unused_4           : 1;  // 4
+        unsigned int p0_r1              : 1;  // 5
+        unsigned int p0_b1              : 1;  // 6
+        unsigned int unused_7_11        : 5;  // 7..11
+        unsigned int p0_r2              : 1;  // 12
+        unsigned int p0_g1              : 1;  // 13
+        unsigned int unused_14_15       : 2;  // 14,15
+        unsigned int p0_g2              : 1;  // 16
+        unsigned int clock              : 1;  // 17
+        unsigned int output_enable      : 1;  // 18
+        unsigned int unused_19          : 1;  // 19
+        unsigned int d                  : 1;  // 20
+        unsigned int strobe             : 1;  // 21
+        unsigned int a                  : 1;  // 22
+        unsigned int p0_b2              : 1;  // 23
+        unsigned int unused_24_25       : 2;  // 24,25
+        unsigned int b                  : 1;  // 26
+        unsigned int c                  : 1;  // 27
+      } bits;
+      uint32_t raw;
+      IoBits() : raw(0) {}
+    };
+  };
+
   // Classic pinout before July 2015. Consider upgrading to the new pinout.
-  union IoBits {
-    struct {
-      // This bitset reflects the GPIO mapping. The naming of the
-      // pins of type 'p0_r1' means 'first parallel chain, red-bit one'
-#ifdef ONLY_SINGLE_CHAIN
-#     define PI_REV1_RGB_PINOUT_
-      // The Revision1 and Revision2 boards have different GPIO mappings
-      // on the pins 2 and 3. Just use both interpretations.
-      // To keep the I2C pins free, we don't use these anymore.
-      unsigned int output_enable_rev1 : 1;  // 0      (RPi 1, Revision 1)
-      unsigned int clock_rev1         : 1;  // 1      (RPi 1, Revision 1)
-      unsigned int output_enable_rev2 : 1;  // 2      (Pi1.Rev2; masks: I2C SDA)
-      unsigned int clock_rev2         : 1;  // 3      (Pi1.Rev2; masks: I2C SCL)
-#else
-      unsigned int unused_0_1         : 2;  // 0..1   (only on RPi 1, Revision 1)
-      unsigned int p2_g1              : 1;  // 2      (masks SDA when parallel=3)
-      unsigned int p2_b1              : 1;  // 3      (masks SCL when parallel=3)
-#endif
-      unsigned int strobe             : 1;  // 4
-      unsigned int p1_g1              : 1;  // 5      (only on A+/B+/Pi2)
-      unsigned int p1_b1              : 1;  // 6      (only on A+/B+/Pi2)
-      // row: 7..10, but separated as seprate bits to make it easier to shuffle
-      // bits if needed.
-      unsigned int a                  : 1;  // 7      (masks: SPI0_CE1)
-      unsigned int b                  : 1;  // 8      (masks: SPI0_CE0)
-      unsigned int c                  : 1;  // 9      (masks: SPI0_MISO)
-      unsigned int d                  : 1;  // 10     (masks: SPI0_MOSI)
-      unsigned int clock              : 1;  // 11     (masks: SPI0_SCKL)
-      unsigned int p1_r1              : 1;  // 12     (only on A+/B+/Pi2)
-      unsigned int p1_g2              : 1;  // 13     (only on A+/B+/Pi2)
-      unsigned int p2_r1              : 1;  // 14     (masks TxD when parallel=3)
-      unsigned int p2_r2              : 1;  // 15     (masks RxD when parallel=3)
-      unsigned int unused_16          : 1;  // 16     (only on A+/B+/Pi2)
-      unsigned int p0_r1              : 1;  // 17
-      unsigned int p0_g1              : 1;  // 18
-      unsigned int p1_r2              : 1;  // 19     (only on A+/B+/Pi2)
-      unsigned int p1_b2              : 1;  // 20     (only on A+/B+/Pi2)
-      unsigned int p2_b2              : 1;  // 21     (only on A+/B+/Pi2)
-      unsigned int p0_b1              : 1;  // 22
-      unsigned int p0_r2              : 1;  // 23
-      unsigned int p0_g2              : 1;  // 24
-      unsigned int p0_b2              : 1;  // 25
-      unsigned int p2_g2              : 1;  // 26     (only on A+/B+/Pi2)
-      unsigned int output_enable      : 1;  // 27     (Not on RPi1, Rev1)
-    } bits;
-    uint32_t raw;
-    IoBits() : raw(0) {}
+  struct ClassicPinout {
+    union IoBits {
+      struct {
+        unsigned int unused_0_1         : 2;  // 0..1   (only on RPi 1, Revision 1)
+        unsigned int p2_g1              : 1;  // 2      (masks SDA when parallel=3)
+        unsigned int p2_b1              : 1;  // 3      (masks SCL when parallel=3)
+        unsigned int strobe             : 1;  // 4
+        unsigned int p1_g1              : 1;  // 5      (only on A+/B+/Pi2)
+        unsigned int p1_b1              : 1;  // 6      (only on A+/B+/Pi2)
+        // row: 7..10, but separated as seprate bits to make it easier to shuffle
+        // bits if needed.
+        unsigned int a                  : 1;  // 7      (masks: SPI0_CE1)
+        unsigned int b                  : 1;  // 8      (masks: SPI0_CE0)
+        unsigned int c                  : 1;  // 9      (masks: SPI0_MISO)
+        unsigned int d                  : 1;  // 10     (masks: SPI0_MOSI)
+        unsigned int clock              : 1;  // 11     (masks: SPI0_SCKL)
+        unsigned int p1_r1              : 1;  // 12     (only on A+/B+/Pi2)
+        unsigned int p1_g2              : 1;  // 13     (only on A+/B+/Pi2)
+        unsigned int p2_r1              : 1;  // 14     (masks TxD when parallel=3)
+        unsigned int p2_r2              : 1;  // 15     (masks RxD when parallel=3)
+        unsigned int unused_16          : 1;  // 16     (only on A+/B+/Pi2)
+        unsigned int p0_r1              : 1;  // 17
+        unsigned int p0_g1              : 1;  // 18
+        unsigned int p1_r2              : 1;  // 19     (only on A+/B+/Pi2)
+        unsigned int p1_b2              : 1;  // 20     (only on A+/B+/Pi2)
+        unsigned int p2_b2              : 1;  // 21     (only on A+/B+/Pi2)
+        unsigned int p0_b1              : 1;  // 22
+        unsigned int p0_r2              : 1;  // 23
+        unsigned int p0_g2              : 1;  // 24
+        unsigned int p0_b2              : 1;  // 25
+        unsigned int p2_g2              : 1;  // 26     (only on A+/B+/Pi2)
+        unsigned int output_enable      : 1;  // 27     (Not on RPi1, Rev1)
+      } bits;
+      uint32_t raw;
+      IoBits() : raw(0) {}
+    };
   };
-#else
-  // Standard pinout since July 2015
-  // This uses the PWM pin to create the timing.
-  union IoBits {
-    struct {
-      // This bitset reflects the GPIO mapping. The naming of the
-      // pins of type 'p0_r1' means 'first parallel chain, red-bit one'
-      //                                 GPIO Header-pos
-      unsigned int unused_0_1     : 2;  //  0..1  (only on RPi 1, Revision 1)
-      unsigned int p2_g1          : 1;  //  2 P1-03 (masks SDA when parallel=3)
-      unsigned int p2_b1          : 1;  //  3 P1-05 (masks SCL when parallel=3)
-      unsigned int strobe         : 1;  //  4 P1-07
-      unsigned int p1_g1          : 1;  //  5 P1-29 (only on A+/B+/Pi2)
-      unsigned int p1_b1          : 1;  //  6 P1-31 (only on A+/B+/Pi2)
-      // TODO: be able to disable chain 0 for higher-pin RPis to gain SPI back.
-      unsigned int p0_b1          : 1;  //  7 P1-26 (masks: SPI0_CE1)
-      unsigned int p0_r2          : 1;  //  8 P1-24 (masks: SPI0_CE0)
-      unsigned int p0_g2          : 1;  //  9 P1-21 (masks: SPI0_MISO
-      unsigned int p0_b2          : 1;  // 10 P1-19 (masks: SPI0_MOSI)
-      unsigned int p0_r1          : 1;  // 11 P1-23 (masks: SPI0_SCKL)
-
-      unsigned int p1_r1          : 1;  // 12 P1-32 (only on A+/B+/Pi2)
-      unsigned int p1_g2          : 1;  // 13 P1-33 (only on A+/B+/Pi2)
-      unsigned int p2_r1          : 1;  // 14 P1-08 (masks TxD when parallel=3)
-      unsigned int unused_15      : 1;  // 15 P1-10 (RxD) - kept free.
-      unsigned int p2_g2          : 1;  // 16 P1-36 (only on A+/B+/Pi2)
-
-      unsigned int clock          : 1;  // 17 P1-11
-
-      unsigned int output_enable  : 1;  // 18 P1-12 (PWM pin: our timing)
-      unsigned int p1_r2          : 1;  // 19 P1-35 (only on A+/B+/Pi2)
-      unsigned int p1_b2          : 1;  // 20 P1-38 (only on A+/B+/Pi2)
-      unsigned int p2_b2          : 1;  // 21 P1-40 (only on A+/B+/Pi2)
-
-      unsigned int a              : 1;  // 22 P1-15  // row bits.
-      unsigned int b              : 1;  // 23 P1-16
-      unsigned int c              : 1;  // 24 P1-18
-      unsigned int d              : 1;  // 25 P1-22
-
-      unsigned int p2_r2          : 1;  // 26 P1-37 (only on A+/B+/Pi2)
-      unsigned int p0_g1          : 1;  // 27 P1-13 (Not on RPi1, Rev1)
-    } bits;
-    uint32_t raw;
-    IoBits() : raw(0) {}
+
+  // Classic pinout for the Raspberry Pi 1. The Revision1 and Revision2
+  // boards have different GPIO mappings on the pins 2 and 3. Just use both
+  // interpretations. Only supports one chain.
+  struct ClassicPi1Pinout {
+    union IoBits {
+      struct {
+        // To keep the I2C pins free, we don't use these anymore.
+        unsigned int output_enable_rev1 : 1;  // 0      (RPi 1, Revision 1)
+        unsigned int clock_rev1         : 1;  // 1      (RPi 1, Revision 1)
+        unsigned int output_enable_rev2 : 1;  // 2      (Pi1.Rev2; masks: I2C SDA)
+        unsigned int clock_rev2         : 1;  // 3      (Pi1.Rev2; masks: I2C SCL)
+        unsigned int strobe             : 1;  // 4
+        unsigned int unused_5_6         : 2;  // 5..6
+        unsigned int a                  : 1;  // 7      (masks: SPI0_CE1)
+        unsigned int b                  : 1;  // 8      (masks: SPI0_CE0)
+        unsigned int c                  : 1;  // 9      (masks: SPI0_MISO)
+        unsigned int d                  : 1;  // 10     (masks: SPI0_MOSI)
+        unsigned int clock              : 1;  // 11     (masks: SPI0_SCKL)
+        unsigned int unused_12_16       : 5;  // 12..16
+        unsigned int p0_r1              : 1;  // 17
+        unsigned int p0_g1              : 1;  // 18
+        unsigned int unused_19_21       : 3;  // 19..21
+        unsigned int p0_b1              : 1;  // 22
+        unsigned int p0_r2              : 1;  // 23
+        unsigned int p0_g2              : 1;  // 24
+        unsigned int p0_b2              : 1;  // 25
+        unsigned int unused_26          : 1;  // 26
+        unsigned int output_enable      : 1;  // 27     (Not on RPi1, Rev1)
+      } bits;
+      uint32_t raw;
+      IoBits() : raw(0) {}
+    };
   };
-#endif
-
-  // The frame-buffer is organized in bitplanes.
-  // Highest level (slowest to cycle through) are double rows.
-  // For each double-row, we store pwm-bits columns of a bitplane.
-  // Each bitplane-column is pre-filled IoBits, of which the colors are set.
-  // Of course, that means that we store unrelated bits in the frame-buffer,
-  // but it allows easy access in the critical section.
-  IoBits *bitplane_buffer_;
-  inline IoBits *ValueAt(int double_row, int column, int bit);
+
+  // Signals of the pins all mappings have and of the parallel chains 1
+  // and 2, for the mappings that support them.
+  template <class Pinout> static void GetCommonSignals(Signals *signals);
+  template <class Pinout> static void GetParallelSignals(Signals *signals);
+
+  // The frame-buffer is organized in bitplanes; only the "count" most
+  // significant ones are stored: the PWM bits and below them the dither
+  // bits.
+  // Within each bitplane, we store the columns of each double row, one
+  // after another for each parallel chain.
+  // Only the color bits are stored, packed into a byte per column and
+  // chain: bits 0..2 red, green, blue of the upper sub-panel; 3..5 of the
+  // lower. These are expanded to IoBits while clocking out.
+  struct Bitplanes {
+    int count;      // Number of bitplanes, PWM bits plus dither bits.
+    int dither;     // How many of them are dither bits.
+    uint8_t *data;
+    bool owned;     // If we have to delete the data.
+    // For each bitplane, a bit for each double-row that is not all black.
+    // Only ever set while drawing; cleared by Clear() and Fill() and
+    // exact after Analyze().
+    uint16_t *nonblank;
+    // For each bitplane, a bit for each double-row that is the same as in
+    // the bitplane before. See Analyze().
+    uint16_t *repeated;
+    int blank_planes;  // Number of all black least significant bitplanes.
+  };
+  Bitplanes *NewBitplanes(int count, int dither) const;
+  Bitplanes *NewExternalBitplanes(int count, int dither, uint8_t *data) const;
+  bool SetBitplanes(int pwm_bits, int dither_bits);
+  static void DeleteBitplanes(Bitplanes *planes);
+  int plane_size() const { return double_rows_ * parallel_ * columns_; }
+  inline uint8_t *ValueAt(const Bitplanes *planes,
+                          int double_row, int column, int bit);
+  inline uint32_t ExpandColumn(const uint32_t *expansion,
+                               const uint8_t *data) const;
+
+  void ClearBitplanes();
+  // Encode "width" pixels from "rgb" starting at PixelPosition() "pos".
+  void EncodeRow(uint32_t pos, int width, const uint8_t *rgb);
+  void ReencodeFromShadow();
+
+  Bitplanes *planes_;
+  std::vector<Bitplanes*> retired_planes_;  // Replaced by SetBitplanes().
+  void RetirePlanes(Bitplanes *old_planes);
+  bool displayed_;  // If DumpToMatrix() has ever been called.
+
+  // Shadow buffer, if enabled: the RGB values of the upper sub-panels in
+  // the order of the columns in a bitplane, then those of the lower ones.
+  uint8_t *shadow_;
+  uint8_t *ShadowAt(uint32_t pos) const {
+    return shadow_ + 3 * ((pos >> 8) + ((pos & 7) ? plane_size() : 0));
+  }
+
+  // Compiled output, see Compile(). Per double-row and bitplane, each
+  // column is a pair of words: the bits to clear and the bits to set.
+  // Allocated on first use.
+  uint32_t *compiled_buffer_;
+  inline uint32_t *CompiledAt(int double_row, int bit);
+  bool CompileNext();
+  bool compiled_valid_;
+  int compile_next_;     // Next double_row * kBitPlanes + bit to compile.
+  bool analysis_valid_;  // If the results of Analyze() are up to date.
+  bool skip_blank_planes_;
+
+  // The content changed; what Compile() and Analyze() found is outdated.
+  void ContentChanged() {
+    compiled_valid_ = analysis_valid_ = false;
+    compile_next_ = 0;
+  }
 };
 }  // namespace internal
 }  // namespace rgb_matrix
@@ -25,116 +25,495 @@
 #include <string.h>
 #include <math.h>
 
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  include <arm_neon.h>
+#  define RGB_MATRIX_NEON 1
+#endif
+
 #include "gpio.h"
+#include "gpio-internal.h"
 
 namespace rgb_matrix {
 namespace internal {
 enum {
-  kBitPlanes = 11  // maximum usable bitplanes.
+  kBitPlanes = Framebuffer::kMaxBitPlanes  // maximum usable bitplanes.
 };
 
 // Lower values create a higher framerate, but display will be a
 // bit dimmer. Good values are between 100 and 200.
 static const long kBaseTimeNanos = 130;
 
+// The shortest output-enable pulse we ask for when scaling down the pulses
+// for the output brightness: the shortest one at full brightness, which
+// is the resolution of the hardware pulser.
+static const long kMinPulseNanos = kBaseTimeNanos;
+
+// Output brightness in percent; selects the pulse lengths DumpToMatrix()
+// uses. See SetOutputBrightness().
+static int sOutputBrightness = 100;
+
 // We need one global instance of a timing correct pulser. There are different
 // implementations depending on the context.
 static PinPulser *sOutputEnablePulser = NULL;
 
-// The Adafruit HAT only supports one chain.
-#if defined(ADAFRUIT_RGBMATRIX_HAT) || defined(ADAFRUIT_RGBMATRIX_HAT_PWM)
-#  define ONLY_SINGLE_CHAIN 1
+// If the shift registers of the panels hold all black, so that clocking
+// in another all black row can be skipped. Only used in DumpToMatrix().
+static bool sShiftRegistersBlank = false;
+
+// Counts refreshes to take turns with the dither bits in DumpToMatrix().
+static uint32_t sDitherCount = 0;
+
+// The hardware mappings, see SetHardwareMapping().
+enum HardwareMapping {
+  kRegularMapping,
+  kAdafruitHatMapping,
+  kAdafruitHatPwmMapping,
+  kClassicMapping,
+  kClassicPi1Mapping,
+  kMappingCount
+};
+static const char *const kMappingNames[kMappingCount] = {
+  "regular", "adafruit-hat", "adafruit-hat-pwm", "classic", "classic-pi1"
+};
+
+// The defaults can be chosen at compile time, see lib/Makefile.
+#if defined(ADAFRUIT_RGBMATRIX_HAT_PWM)
+static int sHardwareMapping = kAdafruitHatPwmMapping;
+#elif defined(ADAFRUIT_RGBMATRIX_HAT)
+static int sHardwareMapping = kAdafruitHatMapping;
+#elif defined(RGB_CLASSIC_PINOUT) && defined(ONLY_SINGLE_CHAIN)
+static int sHardwareMapping = kClassicPi1Mapping;
+#elif defined(RGB_CLASSIC_PINOUT)
+static int sHardwareMapping = kClassicMapping;
+#else
+static int sHardwareMapping = kRegularMapping;
+#endif
+
+#ifdef INVERSE_RGB_DISPLAY_COLORS
+static bool sInverseColors = true;
+#else
+static bool sInverseColors = false;
 #endif
 
-Framebuffer::Framebuffer(int rows, int columns, int parallel)
+// The Signals of the hardware mapping and, for each parallel chain, the
+// GPIO bits for each of the 64 possible values of the packed color bits.
+// All output is done with these, so that the mapping is only looked at
+// when it changes.
+static Framebuffer::Signals sSignals;
+static uint32_t sColorExpansion[3 * 64];
+
+static void UpdateSignals() {
+  Framebuffer::GetSignals(&sSignals);
+  for (int chain = 0; chain < 3; ++chain) {
+    for (int packed = 0; packed < 64; ++packed) {
+      uint32_t value = 0;
+      for (int bit = 0; bit < 6; ++bit) {
+        if (((packed & (1 << bit)) != 0) != sSignals.inverse_colors)
+          value |= sSignals.color[chain][bit / 3][bit % 3];
+      }
+      sColorExpansion[chain * 64 + packed] = value;
+    }
+  }
+}
+
+// Sets up the tables above on first use.
+static void InitSignals() {
+  static const bool initialized = (UpdateSignals(), true);
+  (void) initialized;
+}
+
+Framebuffer::Framebuffer(int rows, int columns, int parallel,
+                         int pwm_bits, int dither_bits,
+                         uint8_t *external_data)
   : rows_(rows),
     parallel_(parallel),
     height_(rows * parallel),
     columns_(columns),
-    pwm_bits_(kBitPlanes), do_luminance_correct_(true), brightness_(100),
-    double_rows_(rows / 2), row_mask_(double_rows_ - 1) {
-  bitplane_buffer_ = new IoBits [double_rows_ * columns_ * kBitPlanes];
-  Clear();
+    do_luminance_correct_(true), brightness_(100),
+    color_lut_(ColorLUT(do_luminance_correct_, brightness_)),
+    double_rows_(rows / 2), row_mask_(double_rows_ - 1),
+    displayed_(false), shadow_(NULL), compiled_buffer_(NULL),
+    compiled_valid_(false), compile_next_(0), analysis_valid_(false),
+    skip_blank_planes_(false) {
+  assert(pwm_bits >= 1 && dither_bits >= 0
+         && pwm_bits + dither_bits <= kBitPlanes);
+  if (external_data != NULL) {
+    planes_ = NewExternalBitplanes(pwm_bits + dither_bits, dither_bits,
+                                   external_data);
+  } else {
+    planes_ = NewBitplanes(pwm_bits + dither_bits, dither_bits);
+    Clear();
+  }
   assert(rows_ <= 32);
   assert(parallel >= 1 && parallel <= 3);
-#ifdef ONLY_SINGLE_CHAIN
-  if (parallel > 1) {
-    fprintf(stderr, "ONLY_SINGLE_CHAIN is defined, but parallel > 1 given\n");
-    assert(parallel == 1);
-  }
-#endif
 }
 
 Framebuffer::~Framebuffer() {
-  delete [] bitplane_buffer_;
+  FreeRetiredPlanes();
+  DeleteBitplanes(planes_);
+  delete [] shadow_;
+  delete [] compiled_buffer_;
 }
 
 /* static */ void Framebuffer::InitGPIO(GPIO *io, int parallel) {
   if (sOutputEnablePulser != NULL)
     return;  // already initialized.
 
+  InitSignals();
+  const Signals &sig = sSignals;
+  if (sig.color[parallel - 1][0][0] == 0) {
+    fprintf(stderr, "The %s hardware mapping does not support %d "
+            "parallel chains\n", hardware_mapping(), parallel);
+    assert(parallel == 1);
+  }
+
   // Tell GPIO about all bits we intend to use.
-  IoBits b;
-  b.raw = 0;
+  uint32_t bits = sig.output_enable | sig.clock | sig.strobe;
+  for (int p = 0; p < parallel; ++p) {
+    for (int s = 0; s < 2; ++s) {
+      for (int c = 0; c < 3; ++c) bits |= sig.color[p][s][c];
+    }
+  }
+  for (int i = 0; i < 4; ++i) bits |= sig.row_address[i];
 
-#ifdef PI_REV1_RGB_PINOUT_
-  b.bits.output_enable_rev1 = b.bits.output_enable_rev2 = 1;
-  b.bits.clock_rev1 = b.bits.clock_rev2 = 1;
-#endif
+  if (sHardwareMapping == kAdafruitHatPwmMapping) {
+    // Hack: the user soldered together GPIO 18 (new OE) with GPIO 4 (old
+    // OE). We want to make extra sure that, whatever the outside system
+    // set as pinmux, the old OE is not also set as output so that these
+    // GPIO outputs don't fight each other.
+    io->InitInputs(1 << 4);
+  }
 
-  b.bits.output_enable = 1;
+  // Initialize outputs, make sure that all of these are supported bits.
+  const uint32_t result = io->InitOutputs(bits);
+  assert(result == bits);
+
+  // The pulse lengths of each bitplane for every output brightness.
+  std::vector<int> bitplane_timings;
+  for (int percent = 1; percent <= 100; ++percent) {
+    for (int b = 0; b < kBitPlanes; ++b) {
+      const long nanos = (kBaseTimeNanos << b) * percent / 100;
+      bitplane_timings.push_back(nanos < kMinPulseNanos
+                                 ? kMinPulseNanos : nanos);
+    }
+  }
+  sOutputEnablePulser = PinPulser::Create(io, sig.output_enable,
+                                          bitplane_timings);
+}
+
+/* static */ void Framebuffer::SetIdleTask(IdleTask *task) {
+  if (sOutputEnablePulser != NULL) sOutputEnablePulser->SetIdleTask(task);
+}
+
+/* static */ void Framebuffer::SetOutputBrightness(uint8_t percent) {
+  if (percent < 1) percent = 1;
+  if (percent > 100) percent = 100;
+  __atomic_store_n(&sOutputBrightness, percent, __ATOMIC_RELAXED);
+}
+
+/* static */ uint8_t Framebuffer::output_brightness() {
+  return __atomic_load_n(&sOutputBrightness, __ATOMIC_RELAXED);
+}
+
+#define SET_SIGNAL(p, s, c, field) \
+  b.raw = 0; b.bits.field = 1; signals->color[p][s][c] = b.raw
+
+template <class Pinout>
+/* static */ void Framebuffer::GetCommonSignals(Signals *signals) {
+  typename Pinout::IoBits b;
   b.bits.clock = 1;
+  signals->clock = b.raw;
+
+  b.raw = 0;
   b.bits.strobe = 1;
+  signals->strobe = b.raw;
+
+  b.raw = 0;
+  b.bits.output_enable = 1;
+  signals->output_enable = b.raw;
 
-  b.bits.p0_r1 = b.bits.p0_g1 = b.bits.p0_b1 = 1;
-  b.bits.p0_r2 = b.bits.p0_g2 = b.bits.p0_b2 = 1;
+  b.raw = 0; b.bits.a = 1; signals->row_address[0] = b.raw;
+  b.raw = 0; b.bits.b = 1; signals->row_address[1] = b.raw;
+  b.raw = 0; b.bits.c = 1; signals->row_address[2] = b.raw;
+  b.raw = 0; b.bits.d = 1; signals->row_address[3] = b.raw;
 
-#ifndef ONLY_SINGLE_CHAIN
-  if (parallel >= 2) {
-    b.bits.p1_r1 = b.bits.p1_g1 = b.bits.p1_b1 = 1;
-    b.bits.p1_r2 = b.bits.p1_g2 = b.bits.p1_b2 = 1;
+  SET_SIGNAL(0, 0, 0, p0_r1); SET_SIGNAL(0, 0, 1, p0_g1);
+  SET_SIGNAL(0, 0, 2, p0_b1); SET_SIGNAL(0, 1, 0, p0_r2);
+  SET_SIGNAL(0, 1, 1, p0_g2); SET_SIGNAL(0, 1, 2, p0_b2);
+}
+
+template <class Pinout>
+/* static */ void Framebuffer::GetParallelSignals(Signals *signals) {
+  typename Pinout::IoBits b;
+  SET_SIGNAL(1, 0, 0, p1_r1); SET_SIGNAL(1, 0, 1, p1_g1);
+  SET_SIGNAL(1, 0, 2, p1_b1); SET_SIGNAL(1, 1, 0, p1_r2);
+  SET_SIGNAL(1, 1, 1, p1_g2); SET_SIGNAL(1, 1, 2, p1_b2);
+  SET_SIGNAL(2, 0, 0, p2_r1); SET_SIGNAL(2, 0, 1, p2_g1);
+  SET_SIGNAL(2, 0, 2, p2_b1); SET_SIGNAL(2, 1, 0, p2_r2);
+  SET_SIGNAL(2, 1, 1, p2_g2); SET_SIGNAL(2, 1, 2, p2_b2);
+}
+#undef SET_SIGNAL
+
+/* static */ void Framebuffer::GetSignals(Signals *signals) {
+  memset(signals, 0, sizeof(*signals));
+  switch (sHardwareMapping) {
+  case kRegularMapping:
+    GetCommonSignals<RegularPinout>(signals);
+    GetParallelSignals<RegularPinout>(signals);
+    break;
+  case kAdafruitHatMapping:
+    GetCommonSignals<AdafruitHatPinout>(signals);
+    break;
+  case kAdafruitHatPwmMapping:
+    GetCommonSignals<AdafruitHatPwmPinout>(signals);
+    break;
+  case kClassicMapping:
+    GetCommonSignals<ClassicPinout>(signals);
+    GetParallelSignals<ClassicPinout>(signals);
+    break;
+  case kClassicPi1Mapping: {
+    GetCommonSignals<ClassicPi1Pinout>(signals);
+    // Revision 1 and 2 boards differ in pins 0..3; use both.
+    ClassicPi1Pinout::IoBits b;
+    b.bits.clock_rev1 = b.bits.clock_rev2 = 1;
+    signals->clock |= b.raw;
+    b.raw = 0;
+    b.bits.output_enable_rev1 = b.bits.output_enable_rev2 = 1;
+    signals->output_enable |= b.raw;
+    break;
   }
+  }
+  signals->inverse_colors = sInverseColors;
+}
 
-  if (parallel >= 3) {
-    b.bits.p2_r1 = b.bits.p2_g1 = b.bits.p2_b1 = 1;
-    b.bits.p2_r2 = b.bits.p2_g2 = b.bits.p2_b2 = 1;
+/* static */ bool Framebuffer::SetHardwareMapping(const char *name) {
+  if (sOutputEnablePulser != NULL)
+    return false;  // Already in use.
+  for (int i = 0; i < kMappingCount; ++i) {
+    if (strcmp(name, kMappingNames[i]) == 0) {
+      sHardwareMapping = i;
+      UpdateSignals();
+      return true;
+    }
   }
-#endif
+  return false;
+}
 
-  b.bits.a = b.bits.b = b.bits.c = b.bits.d = 1;
+/* static */ const char *Framebuffer::hardware_mapping() {
+  return kMappingNames[sHardwareMapping];
+}
 
-  // Initialize outputs, make sure that all of these are supported bits.
-  const uint32_t result = io->InitOutputs(b.raw);
-  assert(result == b.raw);
-
-  // Now, set up the PinPulser for output enable.
-  IoBits output_enable_bits;
-#ifdef PI_REV1_RGB_PINOUT_
-  output_enable_bits.bits.output_enable_rev1
-    = output_enable_bits.bits.output_enable_rev2 = 1;
-#endif
-  output_enable_bits.bits.output_enable = 1;
+/* static */ bool Framebuffer::SetInverseColors(bool on) {
+  if (sOutputEnablePulser != NULL)
+    return false;  // Already in use.
+  sInverseColors = on;
+  UpdateSignals();
+  return true;
+}
 
-  std::vector<int> bitplane_timings;
-  for (int b = 0; b < kBitPlanes; ++b) {
-    bitplane_timings.push_back(kBaseTimeNanos << b);
-  }
-  sOutputEnablePulser = PinPulser::Create(io, output_enable_bits.raw,
-                                          bitplane_timings);
+/* static */ bool Framebuffer::inverse_colors() { return sInverseColors; }
+
+// Packed color bits of black in all sub-panels. Inverse colors are only
+// applied when expanding them to GPIO bits.
+static const uint8_t kBlackBits = 0x00;
+
+Framebuffer::Bitplanes *Framebuffer::NewBitplanes(int count,
+                                                  int dither) const {
+  Bitplanes *planes = new Bitplanes;
+  planes->count = count;
+  planes->dither = dither;
+  planes->data = new uint8_t[count * plane_size()];
+  planes->owned = true;
+  planes->nonblank = new uint16_t[count];
+  planes->repeated = new uint16_t[count];
+  memset(planes->repeated, 0, count * sizeof(uint16_t));
+  planes->blank_planes = 0;
+  return planes;
+}
+
+Framebuffer::Bitplanes *Framebuffer::NewExternalBitplanes(int count,
+                                                          int dither,
+                                                          uint8_t *data) const {
+  Bitplanes *planes = new Bitplanes;
+  planes->count = count;
+  planes->dither = dither;
+  planes->data = data;
+  planes->owned = false;
+  planes->nonblank = new uint16_t[count];
+  memset(planes->nonblank, 0xff, count * sizeof(uint16_t));  // Analyze()
+  planes->repeated = new uint16_t[count];
+  memset(planes->repeated, 0, count * sizeof(uint16_t));
+  planes->blank_planes = 0;
+  return planes;
+}
+
+void Framebuffer::DeleteBitplanes(Bitplanes *planes) {
+  if (planes->owned) delete [] planes->data;
+  delete [] planes->nonblank;
+  delete [] planes->repeated;
+  delete planes;
 }
 
 bool Framebuffer::SetPWMBits(uint8_t value) {
   if (value < 1 || value > kBitPlanes)
     return false;
-  pwm_bits_ = value;
+  // Keep as many of the dither bits as still fit below.
+  const int dither = (planes_->dither < kBitPlanes - value
+                      ? planes_->dither : kBitPlanes - value);
+  return SetBitplanes(value, dither);
+}
+
+bool Framebuffer::SetDitherBits(uint8_t value) {
+  if (pwmbits() + value > kBitPlanes)
+    return false;
+  return SetBitplanes(pwmbits(), value);
+}
+
+bool Framebuffer::SetBitplanes(int pwm_bits, int dither_bits) {
+  Bitplanes *const old_planes = planes_;
+  const int count = pwm_bits + dither_bits;
+  if (count == old_planes->count && dither_bits == old_planes->dither)
+    return true;
+  ContentChanged();
+
+  // Keep the most significant bitplanes we have in common, new lower
+  // bitplanes start out black.
+  Bitplanes *const planes = NewBitplanes(count, dither_bits);
+  const int keep = (count < old_planes->count) ? count : old_planes->count;
+  memset(planes->data, kBlackBits, (count - keep) * plane_size());
+  memcpy(planes->data + (count - keep) * plane_size(),
+         old_planes->data + (old_planes->count - keep) * plane_size(),
+         keep * plane_size());
+  memset(planes->nonblank, 0, (count - keep) * sizeof(uint16_t));
+  memcpy(planes->nonblank + (count - keep),
+         old_planes->nonblank + (old_planes->count - keep),
+         keep * sizeof(uint16_t));
+
+  __atomic_store_n(&planes_, planes, __ATOMIC_RELEASE);
+  RetirePlanes(old_planes);
+  ReencodeFromShadow();  // Fill in the new lower bitplanes.
   return true;
 }
 
-inline Framebuffer::IoBits *Framebuffer::ValueAt(int double_row,
-                                                 int column, int bit) {
-  return &bitplane_buffer_[ double_row * (columns_ * kBitPlanes)
-                            + bit * columns_
-                            + column ];
+void Framebuffer::SetExternalContent(int pwm_bits, int dither_bits,
+                                     uint8_t *data) {
+  const int count = pwm_bits + dither_bits;
+  assert(pwm_bits >= 1 && dither_bits >= 0 && count <= kBitPlanes);
+  ContentChanged();
+  Bitplanes *const planes = NewExternalBitplanes(count, dither_bits, data);
+  Bitplanes *const old_planes = planes_;
+  __atomic_store_n(&planes_, planes, __ATOMIC_RELEASE);
+  RetirePlanes(old_planes);
+  SetShadowBuffer(false);  // Does not match anymore.
+}
+
+bool Framebuffer::CopyFrom(const Framebuffer &other) {
+  if (other.rows_ != rows_ || other.columns_ != columns_
+      || other.parallel_ != parallel_)
+    return false;
+  if (other.shadow_ == NULL) {
+    SetShadowBuffer(false);  // Could not be kept up to date.
+  } else if (shadow_ != NULL) {
+    memcpy(shadow_, other.shadow_, 3 * 2 * plane_size());
+  }
+  // The settings the content was encoded with, for re-encoding and
+  // drawing on.
+  do_luminance_correct_ = other.do_luminance_correct_;
+  brightness_ = other.brightness_;
+  color_lut_ = other.color_lut_;
+
+  // All bitplanes are overwritten, so new ones need no content.
+  const Bitplanes *const from = other.planes_;
+  Bitplanes *const planes = (from->count == planes_->count
+                             && from->dither == planes_->dither)
+    ? planes_ : NewBitplanes(from->count, from->dither);
+  memcpy(planes->data, from->data, from->count * plane_size());
+  memcpy(planes->nonblank, from->nonblank, from->count * sizeof(uint16_t));
+
+  // The same content, so the same analysis.
+  memcpy(planes->repeated, from->repeated, from->count * sizeof(uint16_t));
+  planes->blank_planes = from->blank_planes;
+  if (planes != planes_) {
+    Bitplanes *const old_planes = planes_;
+    __atomic_store_n(&planes_, planes, __ATOMIC_RELEASE);
+    RetirePlanes(old_planes);
+  }
+  analysis_valid_ = other.analysis_valid_;
+  skip_blank_planes_ = other.skip_blank_planes_;
+  compiled_valid_ = false;
+  compile_next_ = 0;
+  return true;
+}
+
+bool Framebuffer::CopyFrom(const Framebuffer &other,
+                           int x, int y, int width, int height) {
+  if (other.rows_ != rows_ || other.columns_ != columns_
+      || other.parallel_ != parallel_
+      || other.planes_->count != planes_->count
+      || other.planes_->dither != planes_->dither)
+    return false;
+  if (x < 0) { width += x; x = 0; }
+  if (y < 0) { height += y; y = 0; }
+  if (x + width > columns_) width = columns_ - x;
+  if (y + height > height_) height = height_ - y;
+  if (width <= 0 || height <= 0) return true;
+  ContentChanged();
+  if (other.shadow_ == NULL) SetShadowBuffer(false);
+
+  const Bitplanes *const from = other.planes_;
+  const int plane_stride = plane_size();
+  for (int row = y; row < y + height; ++row) {
+    const uint32_t pos = PixelPosition(x, row);
+    if (shadow_) memcpy(ShadowAt(pos), other.ShadowAt(pos), 3 * width);
+    // Only the bits of this row's sub-panel; the other half of the double
+    // row might be outside the rectangle.
+    const uint8_t mask = 0x07 << (pos & 7);
+    const uint16_t row_bit = 1 << ((pos >> 3) & 0x1f);
+    const uint8_t *src = from->data + (pos >> 8);
+    uint8_t *dst = planes_->data + (pos >> 8);
+    for (int plane = 0; plane < planes_->count; ++plane) {
+      for (int col = 0; col < width; ++col) {
+        dst[col] = (dst[col] & ~mask) | (src[col] & mask);
+      }
+      planes_->nonblank[plane] |= from->nonblank[plane] & row_bit;
+      src += plane_stride;
+      dst += plane_stride;
+    }
+  }
+  return true;
+}
+
+/* static */ uint32_t Framebuffer::ContentEncoding() {
+  return 1;   // Packed color bits, bitplanes first.
+}
+
+void Framebuffer::RetirePlanes(Bitplanes *old_planes) {
+  // The old bitplanes might be being displayed right now; unless this
+  // frame has never been displayed. See DumpToMatrixImpl() for the other
+  // side.
+  retired_planes_.push_back(old_planes);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (!__atomic_load_n(&displayed_, __ATOMIC_RELAXED))
+    FreeRetiredPlanes();
+}
+
+void Framebuffer::FreeRetiredPlanes() {
+  for (size_t i = 0; i < retired_planes_.size(); ++i) {
+    DeleteBitplanes(retired_planes_[i]);
+  }
+  retired_planes_.clear();
+}
+
+inline uint8_t *Framebuffer::ValueAt(const Bitplanes *planes,
+                                     int double_row, int column, int bit) {
+  return &planes->data[ (bit - (kBitPlanes - planes->count)) * plane_size()
+                        + double_row * (parallel_ * columns_)
+                        + column ];
+}
+
+static const uint32_t *ColorExpansion() {
+  InitSignals();
+  return sColorExpansion;
 }
 
 // Do CIE1931 luminance correction and scale to output bitplanes
@@ -144,226 +523,648 @@ static uint16_t luminance_cie1931(uint8_t c, uint8_t brightness) {
   return out_factor * ((v <= 8) ? v / 902.3 : pow((v + 16) / 116.0, 3));
 }
 
-static uint16_t *CreateLuminanceCIE1931LookupTable() {
-  uint16_t *result = new uint16_t[256 * 100];
-  for (int i = 0; i < 256; ++i)
-    for (int j = 0; j < 100; ++j)
-      result[i * 100 + j] = luminance_cie1931(i, j + 1);
+// Map color value to the bits of all bitplanes.
+static uint16_t MapColorValue(uint8_t c, bool luminance_correct,
+                              uint8_t brightness) {
+  uint16_t result;
+  if (luminance_correct) {
+    result = luminance_cie1931(c, brightness);
+  } else {
+    // simple scale down the color value
+    c = c * brightness / 100;
 
+    enum {shift = kBitPlanes - 8};  //constexpr; shift to be left aligned.
+    result = (shift > 0) ? (c << shift) : (c >> -shift);
+  }
   return result;
 }
 
-inline uint16_t Framebuffer::MapColor(uint8_t c) {
-#ifdef INVERSE_RGB_DISPLAY_COLORS
-#  define COLOR_OUT_BITS(x) (x) ^ 0xffff
-#else
-#  define COLOR_OUT_BITS(x) (x)
-#endif
+/* static */ const Framebuffer::PlaneBits *
+Framebuffer::ColorLUT(bool luminance_correct, uint8_t brightness) {
+  static PlaneBits *cache[2][100];
+  PlaneBits **const entry = &cache[luminance_correct][brightness - 1];
+  PlaneBits *lut = __atomic_load_n(entry, __ATOMIC_ACQUIRE);
+  if (lut != NULL)
+    return lut;
 
-  if (do_luminance_correct_) {
-    static uint16_t *luminance_lookup = CreateLuminanceCIE1931LookupTable();
-    return COLOR_OUT_BITS(luminance_lookup[c * 100 + (brightness_ - 1)]);
-  } else {
-    // simple scale down the color value
-    c = c * brightness_ / 100;
+  lut = new PlaneBits[3 * 256];
+  for (int channel = 0; channel < 3; ++channel) {
+    for (int c = 0; c < 256; ++c) {
+      const uint16_t value = MapColorValue(c, luminance_correct, brightness);
+      PlaneBits *const bits = &lut[channel * 256 + c];
+      memset(bits, 0, sizeof(*bits));
+      for (int b = 0; b < kBitPlanes; ++b) {
+        if (value & (1 << b)) bits->plane[b] = 1 << channel;
+      }
+    }
+  }
+  PlaneBits *expected = NULL;
+  if (!__atomic_compare_exchange_n(entry, &expected, lut, false,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    delete [] lut;  // Another thread was faster.
+    lut = expected;
+  }
+  return lut;
+}
 
-    enum {shift = kBitPlanes - 8};  //constexpr; shift to be left aligned.
-    return COLOR_OUT_BITS((shift > 0) ? (c << shift) : (c >> -shift));
+void Framebuffer::set_luminance_correct(bool on) {
+  if (on == do_luminance_correct_) return;
+  do_luminance_correct_ = on;
+  color_lut_ = ColorLUT(do_luminance_correct_, brightness_);
+  ReencodeFromShadow();
+}
+
+void Framebuffer::SetBrightness(uint8_t b) {
+  b = (b <= 100 ? (b != 0 ? b : 1) : 100);
+  if (b == brightness_) return;
+  brightness_ = b;
+  color_lut_ = ColorLUT(do_luminance_correct_, brightness_);
+  ReencodeFromShadow();
+}
+
+inline Framebuffer::PlaneBits Framebuffer::MapColor(uint8_t r, uint8_t g,
+                                                    uint8_t b) const {
+  const PlaneBits &red = color_lut_[r];
+  const PlaneBits &green = color_lut_[256 + g];
+  const PlaneBits &blue = color_lut_[512 + b];
+  PlaneBits result;
+  result.words[0] = red.words[0] | green.words[0] | blue.words[0];
+  result.words[1] = red.words[1] | green.words[1] | blue.words[1];
+  return result;
+}
+
+void Framebuffer::SetShadowBuffer(bool on) {
+  if (on && shadow_ == NULL) {
+    shadow_ = new uint8_t[3 * 2 * plane_size()];
+    Clear();
+  } else if (!on) {
+    delete [] shadow_;
+    shadow_ = NULL;
+  }
+}
+
+bool Framebuffer::GetPixel(int x, int y,
+                           uint8_t *red, uint8_t *green, uint8_t *blue) const {
+  const uint32_t pos = PixelPosition(x, y);
+  if (shadow_ == NULL || pos == kInvalidPixelPosition)
+    return false;
+  const uint8_t *const pixel = ShadowAt(pos);
+  *red = pixel[0];
+  *green = pixel[1];
+  *blue = pixel[2];
+  return true;
+}
+
+void Framebuffer::ReencodeFromShadow() {
+  if (shadow_ == NULL) return;
+  // Not cleared first: this might be the frame being displayed. All bits
+  // are overwritten; rows that become black just stay marked nonblank
+  // until the next Analyze().
+  ContentChanged();
+  for (int y = 0; y < height_; ++y) {
+    const uint32_t pos = PixelPosition(0, y);
+    EncodeRow(pos, columns_, ShadowAt(pos));
   }
+}
 
-#undef COLOR_OUT_BITS
+void Framebuffer::ClearBitplanes() {
+  ContentChanged();
+  memset(planes_->data, kBlackBits, planes_->count * plane_size());
+  memset(planes_->nonblank, 0, planes_->count * sizeof(uint16_t));
 }
 
 void Framebuffer::Clear() {
-#ifdef INVERSE_RGB_DISPLAY_COLORS
-  Fill(0, 0, 0);
-#else
-  memset(bitplane_buffer_, 0,
-         sizeof(*bitplane_buffer_) * double_rows_ * columns_ * kBitPlanes);
-#endif
+  ClearBitplanes();
+  if (shadow_) memset(shadow_, 0, 3 * 2 * plane_size());
 }
 
 void Framebuffer::Fill(uint8_t r, uint8_t g, uint8_t b) {
-  const uint16_t red   = MapColor(r);
-  const uint16_t green = MapColor(g);
-  const uint16_t blue  = MapColor(b);
-
-  for (int b = kBitPlanes - pwm_bits_; b < kBitPlanes; ++b) {
-    uint16_t mask = 1 << b;
-    IoBits plane_bits;
-    plane_bits.raw = 0;
-    plane_bits.bits.p0_r1 = plane_bits.bits.p0_r2 = (red & mask) == mask;
-    plane_bits.bits.p0_g1 = plane_bits.bits.p0_g2 = (green & mask) == mask;
-    plane_bits.bits.p0_b1 = plane_bits.bits.p0_b2 = (blue & mask) == mask;
-
-#ifndef ONLY_SINGLE_CHAIN
-    plane_bits.bits.p1_r1 = plane_bits.bits.p1_r2 =
-      plane_bits.bits.p2_r1 = plane_bits.bits.p2_r2 = (red & mask) == mask;
-    plane_bits.bits.p1_g1 = plane_bits.bits.p1_g2 =
-      plane_bits.bits.p2_g1 = plane_bits.bits.p2_g2 = (green & mask) == mask;
-    plane_bits.bits.p1_b1 = plane_bits.bits.p1_b2 =
-      plane_bits.bits.p2_b1 = plane_bits.bits.p2_b2 = (blue & mask) == mask;
-#endif
-    for (int row = 0; row < double_rows_; ++row) {
-      IoBits *row_data = ValueAt(row, 0, b);
-      for (int col = 0; col < columns_; ++col) {
-        (row_data++)->raw = plane_bits.raw;
-      }
+  ContentChanged();
+  const PlaneBits color = MapColor(r, g, b);
+  if (shadow_) {
+    for (uint8_t *pixel = shadow_; pixel < shadow_ + 3 * 2 * plane_size();
+         pixel += 3) {
+      pixel[0] = r; pixel[1] = g; pixel[2] = b;
     }
   }
+
+  for (int b = kBitPlanes - planes_->count; b < kBitPlanes; ++b) {
+    const uint8_t plane_bits = color.plane[b] | color.plane[b] << 3;
+    memset(ValueAt(planes_, 0, 0, b), plane_bits, plane_size());
+    planes_->nonblank[b - (kBitPlanes - planes_->count)]
+      = (plane_bits != kBlackBits) ? (1 << double_rows_) - 1 : 0;
+  }
+}
+
+uint32_t Framebuffer::PixelPosition(int x, int y) const {
+  if (x < 0 || x >= columns_ || y < 0 || y >= height_)
+    return kInvalidPixelPosition;
+  // Parallel chain and shift of the bits of the upper or lower sub-panel.
+  int chain = 0;
+  int chain_y = y;
+  while (chain_y >= rows_) {
+    chain_y -= rows_;
+    chain++;
+  }
+  const int shift = (chain_y >= double_rows_) ? 3 : 0;
+  // Offset within a bitplane, so the same for any number of bitplanes.
+  const int double_row = y & row_mask_;
+  const int offset = (double_row * (parallel_ * columns_)
+                      + chain * columns_ + x);
+  return (offset << 8) | (double_row << 3) | shift;
 }
 
 void Framebuffer::SetPixel(int x, int y, uint8_t r, uint8_t g, uint8_t b) {
-  if (x < 0 || x >= columns_ || y < 0 || y >= height_) return;
+  const uint32_t pos = PixelPosition(x, y);
+  if (pos == kInvalidPixelPosition) return;
+  SetPixelAt(pos, r, g, b);
+}
 
-  const uint16_t red   = MapColor(r);
-  const uint16_t green = MapColor(g);
-  const uint16_t blue  = MapColor(b);
+void Framebuffer::SetPixelAt(uint32_t pos, uint8_t r, uint8_t g, uint8_t b) {
+  if (shadow_) {
+    uint8_t *const pixel = ShadowAt(pos);
+    if (pixel[0] == r && pixel[1] == g && pixel[2] == b)
+      return;  // Unchanged.
+    pixel[0] = r; pixel[1] = g; pixel[2] = b;
+  }
+  ContentChanged();
+  const PlaneBits color = MapColor(r, g, b);
 
-  const int min_bit_plane = kBitPlanes - pwm_bits_;
-  IoBits *bits = ValueAt(y & row_mask_, x, min_bit_plane);
+  const int shift = pos & 7;
+  const uint8_t keep = ~(0x07 << shift);
+  const uint16_t row_bit = 1 << ((pos >> 3) & 0x1f);
+  const int plane_stride = plane_size();
 
-  // Manually expand the three cases for better performance.
-  // TODO(hzeller): This is a bit repetetive. Test if it pays off to just
-  // pre-calc rgb mask and apply.
-  if (y < rows_) {
-    // Parallel chain #1
-    if (y < double_rows_) {   // Upper sub-panel.
-      for (int b = min_bit_plane; b < kBitPlanes; ++b) {
-        const uint16_t mask = 1 << b;
-        bits->bits.p0_r1 = (red & mask) == mask;
-        bits->bits.p0_g1 = (green & mask) == mask;
-        bits->bits.p0_b1 = (blue & mask) == mask;
-        bits += columns_;
-      }
-    } else {
-      for (int b = min_bit_plane; b < kBitPlanes; ++b) {
-        const uint16_t mask = 1 << b;
-        bits->bits.p0_r2 = (red & mask) == mask;
-        bits->bits.p0_g2 = (green & mask) == mask;
-        bits->bits.p0_b2 = (blue & mask) == mask;
-        bits += columns_;
+  uint8_t *bits = planes_->data + (pos >> 8);
+  uint16_t *nonblank = planes_->nonblank;
+  for (int b = kBitPlanes - planes_->count; b < kBitPlanes; ++b) {
+    *bits = (*bits & keep) | color.plane[b] << shift;
+    if (*bits != kBlackBits) *nonblank |= row_bit;
+    bits += plane_stride;
+    ++nonblank;
+  }
+}
+
+void Framebuffer::FillRect(int x, int y, int width, int height,
+                           uint8_t r, uint8_t g, uint8_t b) {
+  if (x < 0) { width += x; x = 0; }
+  if (y < 0) { height += y; y = 0; }
+  if (x + width > columns_) width = columns_ - x;
+  if (y + height > height_) height = height_ - y;
+  if (width <= 0 || height <= 0) return;
+  ContentChanged();
+
+  const PlaneBits color = MapColor(r, g, b);
+  const int min_bit_plane = kBitPlanes - planes_->count;
+  const int plane_stride = plane_size();
+
+  // Each row of the rectangle is a contiguous range of columns in each
+  // bitplane, which all get the same value.
+  for (int row = y; row < y + height; ++row) {
+    const uint32_t pos = PixelPosition(x, row);
+    if (shadow_) {
+      uint8_t *pixel = ShadowAt(pos);
+      for (int col = 0; col < width; ++col, pixel += 3) {
+        pixel[0] = r; pixel[1] = g; pixel[2] = b;
       }
     }
-#ifndef ONLY_SINGLE_CHAIN
-  } else if (y >= rows_ && y < 2 * rows_) {
-    // Parallel chain #2
-    if (y - rows_ < double_rows_) {   // Upper sub-panel.
-      for (int b = min_bit_plane; b < kBitPlanes; ++b) {
-        const uint16_t mask = 1 << b;
-        bits->bits.p1_r1 = (red & mask) == mask;
-        bits->bits.p1_g1 = (green & mask) == mask;
-        bits->bits.p1_b1 = (blue & mask) == mask;
-        bits += columns_;
+    const int shift = pos & 7;
+    const uint8_t keep = ~(0x07 << shift);
+    const uint16_t row_bit = 1 << ((pos >> 3) & 0x1f);
+    uint8_t *bits = planes_->data + (pos >> 8);
+    uint16_t *nonblank = planes_->nonblank;
+    for (int plane = min_bit_plane; plane < kBitPlanes; ++plane) {
+      const uint8_t value = color.plane[plane] << shift;
+      for (int col = 0; col < width; ++col) {
+        bits[col] = (bits[col] & keep) | value;
       }
-    } else {
+      if (value != (kBlackBits & ~keep)) *nonblank |= row_bit;
+      bits += plane_stride;
+      ++nonblank;
+    }
+  }
+}
+
+void Framebuffer::SetPixels(int x, int y, int width, int height,
+                            const uint8_t *rgb, int stride) {
+  // Clip to our frame; rgb always points to the pixel at (x, y).
+  if (x < 0) { rgb -= 3 * x; width += x; x = 0; }
+  if (y < 0) { rgb -= stride * y; height += y; y = 0; }
+  if (x + width > columns_) width = columns_ - x;
+  if (y + height > height_) height = height_ - y;
+  if (width <= 0 || height <= 0) return;
+
+  for (int row = y; row < y + height; ++row, rgb += stride) {
+    const uint32_t pos = PixelPosition(x, row);
+    if (shadow_) {
+      uint8_t *const pixels = ShadowAt(pos);
+      if (memcmp(pixels, rgb, 3 * width) == 0)
+        continue;  // Unchanged.
+      memcpy(pixels, rgb, 3 * width);
+    }
+    ContentChanged();
+    EncodeRow(pos, width, rgb);
+  }
+}
+
+#ifdef RGB_MATRIX_NEON
+// Transposes 16x16 bytes: afterwards, row[b] has byte b of all the
+// original rows. Transposes 2x2 bytes, then 2x2 of these 16 bit elements
+// and 32 bit elements (giving 8x8 transposes in each half) and finally
+// swaps the upper left and lower right 8x8 quadrants.
+static inline void Transpose16x16(uint8x16_t row[16]) {
+  for (int i = 0; i < 16; i += 2) {
+    const uint8x16x2_t t = vtrnq_u8(row[i], row[i + 1]);
+    row[i] = t.val[0];
+    row[i + 1] = t.val[1];
+  }
+  for (int i = 0; i < 16; i += 4) {
+    for (int j = i; j < i + 2; ++j) {
+      const uint16x8x2_t t = vtrnq_u16(vreinterpretq_u16_u8(row[j]),
+                                       vreinterpretq_u16_u8(row[j + 2]));
+      row[j] = vreinterpretq_u8_u16(t.val[0]);
+      row[j + 2] = vreinterpretq_u8_u16(t.val[1]);
+    }
+  }
+  for (int i = 0; i < 16; i += 8) {
+    for (int j = i; j < i + 4; ++j) {
+      const uint32x4x2_t t = vtrnq_u32(vreinterpretq_u32_u8(row[j]),
+                                       vreinterpretq_u32_u8(row[j + 4]));
+      row[j] = vreinterpretq_u8_u32(t.val[0]);
+      row[j + 4] = vreinterpretq_u8_u32(t.val[1]);
+    }
+  }
+  for (int j = 0; j < 8; ++j) {
+    const uint8x16_t low = vcombine_u8(vget_low_u8(row[j]),
+                                       vget_low_u8(row[j + 8]));
+    row[j + 8] = vcombine_u8(vget_high_u8(row[j]), vget_high_u8(row[j + 8]));
+    row[j] = low;
+  }
+}
+#endif
+
+void Framebuffer::EncodeRow(uint32_t pos, int width, const uint8_t *rgb) {
+  // We map colors of a batch of pixels first, then transpose them into the
+  // bitplanes. With NEON, full batches are transposed in registers and
+  // each bitplane is updated with a single 16 byte load and store;
+  // otherwise, the inner loops work on a fixed number of independent
+  // columns so that the compiler can vectorize them.
+  enum { kBatch = 16 };
+  PlaneBits color[kBatch];
+
+  const int min_bit_plane = kBitPlanes - planes_->count;
+  const int plane_stride = plane_size();
+  const int shift = pos & 7;
+  const uint8_t keep = ~(0x07 << shift);
+  const uint16_t row_bit = 1 << ((pos >> 3) & 0x1f);
+
+  const uint8_t *pixel = rgb;
+  for (int col = 0; col < width; col += kBatch) {
+    const int count = (width - col < kBatch) ? width - col : kBatch;
+    for (int i = 0; i < count; ++i, pixel += 3) {
+      color[i] = MapColor(pixel[0], pixel[1], pixel[2]);
+    }
+    uint8_t *bits = planes_->data + (pos >> 8) + col;
+    uint16_t *nonblank = planes_->nonblank;
+#ifdef RGB_MATRIX_NEON
+    if (count == kBatch) {
+      uint8x16_t plane[kBatch];
+      for (int i = 0; i < kBatch; ++i) plane[i] = vld1q_u8(color[i].plane);
+      Transpose16x16(plane);
+      const uint8x16_t keep_bits = vdupq_n_u8(keep);
+      const uint8x16_t black = vdupq_n_u8(kBlackBits);
+      const int8x16_t to_row = vdupq_n_s8(shift);
       for (int b = min_bit_plane; b < kBitPlanes; ++b) {
-        const uint16_t mask = 1 << b;
-        bits->bits.p1_r2 = (red & mask) == mask;
-        bits->bits.p1_g2 = (green & mask) == mask;
-        bits->bits.p1_b2 = (blue & mask) == mask;
-        bits += columns_;
+        const uint8x16_t value = vorrq_u8(vandq_u8(vld1q_u8(bits), keep_bits),
+                                          vshlq_u8(plane[b], to_row));
+        vst1q_u8(bits, value);
+        const uint64x2_t differs
+          = vreinterpretq_u64_u8(veorq_u8(value, black));
+        if (vgetq_lane_u64(differs, 0) | vgetq_lane_u64(differs, 1))
+          *nonblank |= row_bit;
+        bits += plane_stride;
+        ++nonblank;
       }
+      continue;
     }
-  } else {
-    // Parallel chain #3
-    if (y - 2*rows_ < double_rows_) {   // Upper sub-panel.
-      for (int b = min_bit_plane; b < kBitPlanes; ++b) {
-        const uint16_t mask = 1 << b;
-        bits->bits.p2_r1 = (red & mask) == mask;
-        bits->bits.p2_g1 = (green & mask) == mask;
-        bits->bits.p2_b1 = (blue & mask) == mask;
-        bits += columns_;
+#endif
+    for (int b = min_bit_plane; b < kBitPlanes; ++b) {
+      uint8_t differs = 0;
+      for (int i = 0; i < count; ++i) {
+        bits[i] = (bits[i] & keep) | color[i].plane[b] << shift;
+        differs |= bits[i] ^ kBlackBits;
       }
-    } else {
-      for (int b = min_bit_plane; b < kBitPlanes; ++b) {
-        const uint16_t mask = 1 << b;
-        bits->bits.p2_r2 = (red & mask) == mask;
-        bits->bits.p2_g2 = (green & mask) == mask;
-        bits->bits.p2_b2 = (blue & mask) == mask;
-        bits += columns_;
+      if (differs) *nonblank |= row_bit;
+      bits += plane_stride;
+      ++nonblank;
+    }
+  }
+}
+
+uint32_t Framebuffer::ColorClockMask() const {
+  InitSignals();
+  uint32_t color_clk_mask = sSignals.clock;
+  for (int p = 0; p < parallel_; ++p) {
+    for (int s = 0; s < 2; ++s) {
+      for (int c = 0; c < 3; ++c) color_clk_mask |= sSignals.color[p][s][c];
+    }
+  }
+  return color_clk_mask;
+}
+
+inline uint32_t *Framebuffer::CompiledAt(int double_row, int bit) {
+  return &compiled_buffer_[2 * (double_row * kBitPlanes + bit) * columns_];
+}
+
+// GPIO bits of all parallel chains for the column at "data", with the
+// table of ColorExpansion().
+inline uint32_t Framebuffer::ExpandColumn(const uint32_t *expansion,
+                                          const uint8_t *data) const {
+  uint32_t value = expansion[*data];
+  for (int chain = 1; chain < parallel_; ++chain) {
+    data += columns_;
+    value |= expansion[chain * 64 + *data];
+  }
+  return value;
+}
+
+void Framebuffer::ReserveCompiled() {
+  if (compiled_buffer_ == NULL) {
+    compiled_buffer_ = new uint32_t[2 * double_rows_ * columns_ * kBitPlanes];
+  }
+}
+
+// Compiles the next row of a bitplane. Returns false if there is none.
+bool Framebuffer::CompileNext() {
+  if (compiled_valid_) return false;
+  // Skip the bitplanes not in use.
+  const int min_bit_plane = kBitPlanes - planes_->count;
+  if (compile_next_ % kBitPlanes < min_bit_plane)
+    compile_next_ += min_bit_plane - compile_next_ % kBitPlanes;
+  if (compile_next_ >= double_rows_ * kBitPlanes) {
+    compiled_valid_ = true;
+    return false;
+  }
+  const int d_row = compile_next_ / kBitPlanes;
+  const int b = compile_next_ % kBitPlanes;
+  const uint32_t color_clk_mask = ColorClockMask();
+  const uint32_t *const expansion = ColorExpansion();
+  const uint8_t *row_data = ValueAt(planes_, d_row, 0, b);
+  uint32_t *out = CompiledAt(d_row, b);
+  for (int col = 0; col < columns_; ++col) {
+    const uint32_t value = ExpandColumn(expansion, row_data + col);
+    *out++ = ~value & color_clk_mask;  // Also resets clock.
+    *out++ = value & color_clk_mask;
+  }
+  ++compile_next_;
+  return true;
+}
+
+void Framebuffer::Compile() {
+  ReserveCompiled();
+  while (CompileNext()) {}
+}
+
+bool Framebuffer::CompileUntil(uint32_t deadline_usec) {
+  if (compiled_buffer_ == NULL) return false;
+  while ((int32_t) (deadline_usec - GetMicrosecondCounter()) > 0) {
+    if (!CompileNext())
+      return true;
+  }
+  return compiled_valid_;
+}
+
+static bool IsBlank(const uint8_t *data, int size) {
+  for (int i = 0; i < size; ++i) {
+    if (data[i] != kBlackBits) return false;
+  }
+  return true;
+}
+
+void Framebuffer::Analyze(bool skip_blank_planes) {
+  skip_blank_planes_ = skip_blank_planes;
+  if (analysis_valid_) return;
+  const int row_size = parallel_ * columns_;
+  const uint8_t *data = planes_->data;
+  int blank_planes = 0;
+  for (int i = 0; i < planes_->count; ++i) {
+    uint16_t nonblank = 0, repeated = 0;
+    for (int d_row = 0; d_row < double_rows_; ++d_row, data += row_size) {
+      const uint16_t row_bit = 1 << d_row;
+      if (i > 0 && memcmp(data, data - plane_size(), row_size) == 0) {
+        repeated |= row_bit;
+        nonblank |= planes_->nonblank[i - 1] & row_bit;
+      } else if (!IsBlank(data, row_size)) {
+        nonblank |= row_bit;
       }
     }
-#endif
+    planes_->nonblank[i] = nonblank;
+    planes_->repeated[i] = repeated;
+    // Always show at least one bitplane.
+    if (nonblank == 0 && blank_planes == i && i < planes_->count - 1)
+      ++blank_planes;
   }
+  planes_->blank_planes = blank_planes;
+  analysis_valid_ = true;
 }
 
-void Framebuffer::DumpToMatrix(GPIO *io) {
-  IoBits color_clk_mask;   // Mask of bits we need to set while clocking in.
-  color_clk_mask.bits.p0_r1
-    = color_clk_mask.bits.p0_g1
-    = color_clk_mask.bits.p0_b1
-    = color_clk_mask.bits.p0_r2
-    = color_clk_mask.bits.p0_g2
-    = color_clk_mask.bits.p0_b2 = 1;
+namespace {
+// Sends the output to the sink of a GPIO instead of its registers.
+class SinkWriter {
+public:
+  explicit SinkWriter(GPIOSink *sink) : sink_(sink) {}
 
-#ifndef ONLY_SINGLE_CHAIN
-  if (parallel_ >= 2) {
-    color_clk_mask.bits.p1_r1
-      = color_clk_mask.bits.p1_g1
-      = color_clk_mask.bits.p1_b1
-      = color_clk_mask.bits.p1_r2
-      = color_clk_mask.bits.p1_g2
-      = color_clk_mask.bits.p1_b2 = 1;
+  inline void SetBits(uint32_t value) {
+    if (value) sink_->SetBits(value);
+  }
+  inline void ClearBits(uint32_t value) {
+    if (value) sink_->ClearBits(value);
   }
+  inline void WriteMaskedBits(uint32_t value, uint32_t mask) {
+    ClearBits(~value & mask);
+    SetBits(value & mask);
+  }
+
+private:
+  GPIOSink *const sink_;
+};
+
+// Writes to the GPIO registers with the slowdown fixed at compile time.
+template <int kSlowdown> class SlowdownWriter {
+public:
+  explicit SlowdownWriter(GPIO *io) : io_(io) {}
 
-  if (parallel_ >= 3) {
-    color_clk_mask.bits.p2_r1
-      = color_clk_mask.bits.p2_g1
-      = color_clk_mask.bits.p2_b1
-      = color_clk_mask.bits.p2_r2
-      = color_clk_mask.bits.p2_g2
-      = color_clk_mask.bits.p2_b2 = 1;
+  inline void SetBits(uint32_t value) { io_->SetBits<kSlowdown>(value); }
+  inline void ClearBits(uint32_t value) { io_->ClearBits<kSlowdown>(value); }
+  inline void WriteMaskedBits(uint32_t value, uint32_t mask) {
+    ClearBits(~value & mask);
+    SetBits(value & mask);
   }
-#endif
 
-#ifdef PI_REV1_RGB_PINOUT_
-  color_clk_mask.bits.clock_rev1 = color_clk_mask.bits.clock_rev2 = 1;
-#endif
-  color_clk_mask.bits.clock = 1;
+private:
+  GPIO *const io_;
+};
+}  // anonymous namespace
+
+void Framebuffer::DumpToMatrix(GPIO *io, DumpTiming *timing, int subframes) {
+  // Decide once per frame, so that writing to the hardware registers
+  // does not have any overhead.
+  if (io->sink() != NULL) {
+    SinkWriter writer(io->sink());
+    DumpToMatrixImpl(&writer, timing, subframes);
+    return;
+  }
+#define DUMP_WITH_SLOWDOWN(n)                                    \
+  case n: {                                                      \
+    SlowdownWriter<n> writer(io);                                \
+    DumpToMatrixImpl(&writer, timing, subframes);                \
+    break;                                                       \
+  }
+  switch (io->slowdown()) {  // One instance up to GPIO::kMaxSlowdown.
+    DUMP_WITH_SLOWDOWN(0);
+    DUMP_WITH_SLOWDOWN(1);
+    DUMP_WITH_SLOWDOWN(2);
+    DUMP_WITH_SLOWDOWN(3);
+    DUMP_WITH_SLOWDOWN(4);
+  }
+#undef DUMP_WITH_SLOWDOWN
+}
 
-  IoBits row_mask;
-  row_mask.bits.a = row_mask.bits.b = row_mask.bits.c = row_mask.bits.d = 1;
+template <class IO>
+void Framebuffer::DumpToMatrixImpl(IO *io, DumpTiming *timing,
+                                   int subframes) {
+  // Mask of bits we need to set while clocking in.
+  const uint32_t color_clk_mask = ColorClockMask();
+  const uint32_t *const expansion = ColorExpansion();
+  const uint32_t clock = sSignals.clock;
+  const uint32_t strobe = sSignals.strobe;
 
-  IoBits clock, strobe, row_address;
-#ifdef PI_REV1_RGB_PINOUT_
-  clock.bits.clock_rev1 = clock.bits.clock_rev2 = 1;
-#endif
-  clock.bits.clock = 1;
-  strobe.bits.strobe = 1;
-
-  const int pwm_to_show = pwm_bits_;  // Local copy, might change in process.
-  for (uint8_t d_row = 0; d_row < double_rows_; ++d_row) {
-    row_address.bits.a = d_row;
-    row_address.bits.b = d_row >> 1;
-    row_address.bits.c = d_row >> 2;
-    row_address.bits.d = d_row >> 3;
-
-    io->WriteMaskedBits(row_address.raw, row_mask.raw);  // Set row address
-
-    // Rows can't be switched very quickly without ghosting, so we do the
-    // full PWM of one row before switching rows.
-    for (int b = kBitPlanes - pwm_to_show; b < kBitPlanes; ++b) {
-      IoBits *row_data = ValueAt(d_row, 0, b);
-      // While the output enable is still on, we can already clock in the next
-      // data.
-      for (int col = 0; col < columns_; ++col) {
-        const IoBits &out = *row_data++;
-        io->WriteMaskedBits(out.raw, color_clk_mask.raw);  // col + reset clock
-        io->SetBits(clock.raw);               // Rising edge: clock color in.
+  // The row address bits of each double row.
+  uint32_t row_address[16];
+  uint32_t row_mask = 0;
+  for (int i = 0; i < 4; ++i) row_mask |= sSignals.row_address[i];
+  for (int d_row = 0; d_row < double_rows_; ++d_row) {
+    row_address[d_row] = 0;
+    for (int i = 0; i < 4; ++i) {
+      if (d_row & (1 << i)) row_address[d_row] |= sSignals.row_address[i];
+    }
+  }
+
+  // Before picking up the bitplanes, make sure RetirePlanes() knows that
+  // they might be in use from now on.
+  if (!__atomic_load_n(&displayed_, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&displayed_, true, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  }
+  // Local copy, might change in process.
+  const Bitplanes *const planes = __atomic_load_n(&planes_, __ATOMIC_ACQUIRE);
+  const int min_bit_plane = kBitPlanes - planes->count;
+  const int dither = planes->dither;
+  const bool use_compiled = compiled_valid_;
+  const bool use_analysis = analysis_valid_;
+  // The pulse lengths for the output brightness start at this index.
+  const int timing_offset = ((__atomic_load_n(&sOutputBrightness,
+                                              __ATOMIC_RELAXED) - 1)
+                             * kBitPlanes);
+  // Least significant bitplanes that are all black don't emit any light.
+  const int first_plane = ((use_analysis && skip_blank_planes_)
+                           ? planes->blank_planes : 0);
+
+  // The bitplanes to show in this refresh and the bit of the pulse
+  // length they are shown with.
+  int show_plane[kBitPlanes + 1], pulse_bit[kBitPlanes + 1];
+  int to_show = 0;
+  if (dither > 0) {
+    // In turns, one of the dither bitplanes with the pulse length of the
+    // lowest PWM bit. The most significant one every second refresh, the
+    // next every fourth ..., so on average each gets its regular share.
+    const uint32_t turn = sDitherCount++ & ((1 << dither) - 1);
+    if (turn != 0) {
+      const int plane = dither - 1 - __builtin_ctz(turn);
+      if (plane >= first_plane) {
+        show_plane[to_show] = plane;
+        pulse_bit[to_show++] = min_bit_plane + dither;
       }
-      io->ClearBits(color_clk_mask.raw);    // clock back to normal.
+    }
+  }
+  for (int plane = (first_plane > dither ? first_plane : dither);
+       plane < planes->count; ++plane) {
+    show_plane[to_show] = plane;
+    pulse_bit[to_show++] = min_bit_plane + plane;
+  }
 
-      // OE of the previous row-data must be finished before strobe.
-      sOutputEnablePulser->WaitPulseFinished();
+  // With sub-frames, the long output-enable pulses of the high bitplanes
+  // are split into shorter ones, one in each sub-frame. The short
+  // bitplanes can't be split; they are shown in one sub-frame each.
+  int split = 0;
+  while ((1 << split) < subframes) ++split;
 
-      io->SetBits(strobe.raw);   // Strobe in the previously clocked in row.
-      io->ClearBits(strobe.raw);
+  uint32_t clocking_start = 0, waiting_start = 0;
+  for (int subframe = 0; subframe < subframes; ++subframe) {
+    for (uint8_t d_row = 0; d_row < double_rows_; ++d_row) {
+      io->WriteMaskedBits(row_address[d_row], row_mask);  // Set row address
 
-      // Now switch on for the sleep time necessary for that bit-plane.
-      sOutputEnablePulser->SendPulse(b);
+      // Rows can't be switched very quickly without ghosting, so we do the
+      // full PWM of one row before switching rows.
+      int last_plane = -1;   // What the shift registers hold.
+      for (int i = 0; i < to_show; ++i) {
+        const int plane = show_plane[i];
+        const int pulse = pulse_bit[i];
+        if (pulse < split && pulse != subframe)
+          continue;
+        const int b = min_bit_plane + plane;
+        const uint8_t *row_data = ValueAt(planes, d_row, 0, b);
+        const bool blank = !(planes->nonblank[plane] & (1 << d_row));
+        const bool repeated = (use_analysis && last_plane == plane - 1
+                               && (planes->repeated[plane] & (1 << d_row)));
+        if (timing) clocking_start = GetMicrosecondCounter();
+        // While the output enable is still on, we can already clock in the
+        // next data. Unless that is what we have clocked in before, the same
+        // as the previous bitplane or all black again: then just latch it
+        // again.
+        if (repeated || (blank && sShiftRegistersBlank)) {
+          // Nothing to clock.
+        } else if (use_compiled) {
+          // Clear and set words are pre-computed; just send them out.
+          const uint32_t *out = CompiledAt(d_row, b);
+          for (int col = 0; col < columns_; ++col, out += 2) {
+            io->ClearBits(out[0]);              // col + reset clock
+            io->SetBits(out[1]);
+            io->SetBits(clock);             // Rising edge: clock color in.
+          }
+        } else {
+          for (int col = 0; col < columns_; ++col) {
+            const uint32_t out = ExpandColumn(expansion, row_data++);
+            io->WriteMaskedBits(out, color_clk_mask);  // col + reset clock
+            io->SetBits(clock);             // Rising edge: clock color in.
+          }
+        }
+        io->ClearBits(color_clk_mask);    // clock back to normal.
+        sShiftRegistersBlank = blank;
+        last_plane = plane;
+
+        if (timing) {
+          waiting_start = GetMicrosecondCounter();
+          timing->clocking += waiting_start - clocking_start;
+        }
+
+        // OE of the previous row-data must be finished before strobe.
+        sOutputEnablePulser->WaitPulseFinished();
+
+        if (timing) timing->waiting += GetMicrosecondCounter() - waiting_start;
+
+        io->SetBits(strobe);   // Strobe in the previously clocked in row.
+        io->ClearBits(strobe);
+
+        // Now switch on for the sleep time necessary for that bit-plane or
+        // its share in this sub-frame.
+        sOutputEnablePulser->SendPulse(timing_offset
+                                       + (pulse < split ? pulse : pulse - split));
+      }
+      if (timing) waiting_start = GetMicrosecondCounter();
+      sOutputEnablePulser->WaitPulseFinished();
+      if (timing) timing->waiting += GetMicrosecondCounter() - waiting_start;
     }
-    sOutputEnablePulser->WaitPulseFinished();
   }
 }
 }  // namespace internal
@@ -0,0 +1,28 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2015 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+#ifndef RPI_GPIO_INTERNAL_H
+#define RPI_GPIO_INTERNAL_H
+
+#include <stdint.h>
+
+namespace rgb_matrix {
+namespace internal {
+// Free running microsecond counter. This is the 1Mhz system timer of the
+// Raspberry Pi once a PinPulser has been created for the hardware, the
+// monotonic system clock otherwise. Wraps around.
+uint32_t GetMicrosecondCounter();
+}  // namespace internal
+}  // namespace rgb_matrix
+#endif  // RPI_GPIO_INTERNAL_H
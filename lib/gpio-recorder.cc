@@ -0,0 +1,214 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2015 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "gpio-recorder.h"
+
+#include <assert.h>
+
+#include "framebuffer-internal.h"
+
+namespace rgb_matrix {
+GPIORecorder::GPIORecorder(size_t max_events) : max_events_(max_events) {
+  Reset();
+}
+
+void GPIORecorder::Reset() {
+  MutexLock l(&mutex_);
+  events_.clear();
+  events_.reserve(max_events_);
+  clock_gettime(CLOCK_MONOTONIC, &start_);
+}
+
+bool GPIORecorder::full() const {
+  MutexLock l(&mutex_);
+  return events_.size() >= max_events_;
+}
+
+void GPIORecorder::GetEvents(std::vector<Event> *events) const {
+  MutexLock l(&mutex_);
+  *events = events_;
+}
+
+void GPIORecorder::SetBits(uint32_t value) { Record(SET_BITS, value, 0); }
+void GPIORecorder::ClearBits(uint32_t value) { Record(CLEAR_BITS, value, 0); }
+void GPIORecorder::StartPulse(uint32_t bits, long nanos) {
+  Record(PULSE, bits, nanos);
+}
+
+void GPIORecorder::Record(EventType type, uint32_t bits, long pulse_nanos) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  MutexLock l(&mutex_);
+  if (events_.size() >= max_events_)
+    return;
+  Event e;
+  e.time_nanos = ((int64_t)(now.tv_sec - start_.tv_sec) * 1000000000LL
+                  + (now.tv_nsec - start_.tv_nsec));
+  e.type = type;
+  e.bits = bits;
+  e.pulse_nanos = pulse_nanos;
+  events_.push_back(e);
+}
+
+Hub75Decoder::Hub75Decoder(int rows, int chained_displays,
+                           int parallel_displays, int subframes)
+  : rows_(rows), columns_(32 * chained_displays), parallel_(parallel_displays),
+    subframes_(subframes), frames_(0), frames_elapsed_nanos_(0),
+    on_nanos_(rows * parallel_displays * columns_ * 3),
+    max_nanos_(rows / 2), row_timing_(rows / 2) {
+  assert(parallel_ >= 1 && parallel_ <= 3);
+  assert(subframes_ >= 1);
+}
+
+void Hub75Decoder::Replay(const std::vector<GPIORecorder::Event> &events,
+                          int max_frames) {
+  internal::Framebuffer::Signals sig;
+  internal::Framebuffer::GetSignals(&sig);
+
+  const int double_rows = rows_ / 2;
+
+  // Shift registers and latches of all color lines of a column, each color
+  // line one bit: bit (parallel * 6 + lower * 3 + color).
+  std::vector<uint32_t> shift(columns_), latch(columns_);
+  int next_shift = 0;  // Position of the oldest value; written next.
+
+  // Accumulated while in a frame; only kept once the frame is complete.
+  std::vector<int64_t> frame_on(on_nanos_.size());
+  std::vector<int64_t> frame_max(double_rows);
+  std::vector<RowTiming> frame_rows(double_rows);
+  bool in_frame = false;
+  int scans = 0;  // Scans through all rows done in this frame.
+  int replayed = 0;
+  int64_t frame_start = 0;
+  int64_t row_start = 0;
+  int last_row = -1;
+
+  uint32_t state = 0;
+  for (size_t i = 0; i < events.size(); ++i) {
+    const GPIORecorder::Event &e = events[i];
+    const uint32_t before = state;
+    if (e.type == GPIORecorder::SET_BITS) {
+      state |= e.bits;
+    } else {
+      state &= ~e.bits;
+    }
+
+    if ((before & sig.clock) != sig.clock && (state & sig.clock) == sig.clock) {
+      uint32_t colors = 0;
+      for (int p = 0; p < parallel_; ++p) {
+        for (int s = 0; s < 2; ++s) {
+          for (int c = 0; c < 3; ++c) {
+            if (sig.color[p][s][c] && (state & sig.color[p][s][c]))
+              colors |= 1 << (p * 6 + s * 3 + c);
+          }
+        }
+      }
+      if (sig.inverse_colors)
+        colors ^= (1 << (parallel_ * 6)) - 1;
+      shift[next_shift] = colors;
+      next_shift = (next_shift + 1) % columns_;
+    }
+
+    if ((before & sig.strobe) == 0 && (state & sig.strobe) != 0) {
+      // The value clocked in first ends up at the far end: x = 0.
+      for (int x = 0; x < columns_; ++x) {
+        latch[x] = shift[(next_shift + x) % columns_];
+      }
+    }
+
+    if (e.type != GPIORecorder::PULSE)
+      continue;
+
+    int row = 0;
+    for (int b = 0; b < 4; ++b) {
+      if (state & sig.row_address[b]) row |= 1 << b;
+    }
+    row &= double_rows - 1;
+
+    if (row != last_row) {
+      if (last_row >= 0) {
+        frame_rows[last_row].elapsed_nanos += e.time_nanos - row_start;
+      }
+      row_start = e.time_nanos;
+      // A scan through all rows ended. Unless that was the last sub-frame,
+      // the frame goes on.
+      if (row < last_row && (!in_frame || ++scans == subframes_)) {
+        // Start of a new frame. Keep what we collected in the previous one.
+        if (in_frame) {
+          ++frames_;
+          frames_elapsed_nanos_ += e.time_nanos - frame_start;
+          for (size_t j = 0; j < frame_on.size(); ++j) {
+            on_nanos_[j] += frame_on[j];
+          }
+          for (int r = 0; r < double_rows; ++r) {
+            max_nanos_[r] += frame_max[r];
+            row_timing_[r].pulses += frame_rows[r].pulses;
+            row_timing_[r].on_nanos += frame_rows[r].on_nanos;
+            row_timing_[r].elapsed_nanos += frame_rows[r].elapsed_nanos;
+          }
+          if (++replayed == max_frames)
+            return;
+        }
+        in_frame = true;
+        scans = 0;
+        frame_start = e.time_nanos;
+        frame_on.assign(frame_on.size(), 0);
+        frame_max.assign(double_rows, 0);
+        frame_rows.assign(double_rows, RowTiming());
+      }
+      last_row = row;
+    }
+
+    frame_rows[row].pulses++;
+    frame_rows[row].on_nanos += e.pulse_nanos;
+    frame_max[row] += e.pulse_nanos;
+    for (int x = 0; x < columns_; ++x) {
+      const uint32_t colors = latch[x];
+      if (!colors) continue;
+      for (int p = 0; p < parallel_; ++p) {
+        for (int s = 0; s < 2; ++s) {
+          const int y = p * rows_ + s * double_rows + row;
+          for (int c = 0; c < 3; ++c) {
+            if (colors & (1 << (p * 6 + s * 3 + c)))
+              frame_on[(y * columns_ + x) * 3 + c] += e.pulse_nanos;
+          }
+        }
+      }
+    }
+  }
+}
+
+int64_t Hub75Decoder::frame_nanos() const {
+  return frames_ > 0 ? frames_elapsed_nanos_ / frames_ : 0;
+}
+
+int64_t Hub75Decoder::OnNanos(int x, int y, int color) const {
+  if (x < 0 || x >= width() || y < 0 || y >= height()) return 0;
+  return on_nanos_[(y * columns_ + x) * 3 + color];
+}
+
+void Hub75Decoder::GetPixel(int x, int y,
+                            uint8_t *red, uint8_t *green, uint8_t *blue) const {
+  if (x < 0 || x >= width() || y < 0 || y >= height()) {
+    *red = *green = *blue = 0;
+    return;
+  }
+  const int64_t max = max_nanos_[(y % rows_) % (rows_ / 2)];
+  uint8_t *const out[3] = { red, green, blue };
+  for (int c = 0; c < 3; ++c) {
+    *out[c] = (max > 0) ? (255 * OnNanos(x, y, c) + max / 2) / max : 0;
+  }
+}
+}  // end namespace rgb_matrix
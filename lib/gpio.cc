@@ -14,6 +14,7 @@
 // along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
 
 #include "gpio.h"
+#include "gpio-internal.h"
 
 #include <assert.h>
 #include <fcntl.h>
@@ -90,7 +91,19 @@ namespace rgb_matrix {
    (1 << 19) | (1 << 20) | (1 << 21) | (1 << 26)
 );
 
-GPIO::GPIO() : output_bits_(0), gpio_port_(NULL) {
+#ifndef RGB_SLOWDOWN_GPIO
+#  define RGB_SLOWDOWN_GPIO 0
+#endif
+
+GPIO::GPIO() : output_bits_(0), slowdown_(RGB_SLOWDOWN_GPIO), sink_(NULL),
+               gpio_port_(NULL) {
+}
+
+bool GPIO::SetSlowdown(int slowdown) {
+  if (slowdown < 0 || slowdown > kMaxSlowdown)
+    return false;
+  __atomic_store_n(&slowdown_, slowdown, __ATOMIC_RELAXED);
+  return true;
 }
 
 uint32_t GPIO::InitOutputs(uint32_t outputs) {
@@ -99,15 +112,6 @@ uint32_t GPIO::InitOutputs(uint32_t outputs) {
     return 0;
   }
 
-#ifdef ADAFRUIT_RGBMATRIX_HAT_PWM
-  // Hack: the user soldered together GPIO 18 (new OE) with GPIO 4 (old OE).
-  // We want to make extra sure that, whatever the outside system set as pinmux,
-  // the old OE is not also set as output so that these GPIO outputs don't fight
-  // each other.
-  // So explicitly set this particular pin as input.
-  INP_GPIO(4);
-#endif
-
   outputs &= kValidBits;   // Sanitize input.
   output_bits_ = outputs;
   for (uint32_t b = 0; b <= 27; ++b) {
@@ -119,6 +123,19 @@ uint32_t GPIO::InitOutputs(uint32_t outputs) {
   return output_bits_;
 }
 
+void GPIO::InitInputs(uint32_t inputs) {
+  if (gpio_port_ == NULL) {
+    fprintf(stderr, "Attempt to init inputs but not yet Init()-ialized.\n");
+    return;
+  }
+  inputs &= kValidBits;
+  for (uint32_t b = 0; b <= 27; ++b) {
+    if (inputs & (1 << b)) {
+      INP_GPIO(b);
+    }
+  }
+}
+
 static bool IsRaspberryPi2() {
   // TODO: there must be a better, more robust way. Can we ask the processor ?
   char buffer[2048];
@@ -173,6 +190,17 @@ bool GPIO::Init() {
   return true;
 }
 
+bool GPIO::Init(GPIOSink *sink) {
+  if (sink == NULL) return false;
+  // Output goes to the sink, but we still need something register-like
+  // to write the pin setup to.
+  gpio_port_ = new uint32_t[REGISTER_BLOCK_SIZE / sizeof(uint32_t)]();
+  gpio_set_bits_ = gpio_port_ + (0x1C / sizeof(uint32_t));
+  gpio_clr_bits_ = gpio_port_ + (0x28 / sizeof(uint32_t));
+  sink_ = sink;
+  return true;
+}
+
 /*
  * We support also other pinouts that don't have the OE- on the hardware
  * PWM output pin, so we need to provide (impefect) 'manual' timing as well.
@@ -188,31 +216,148 @@ public:
   static void sleep_nanos(long t);
 };
 
+static int64_t MonotonicNanos();
+
 // Simplest of PinPulsers. Uses somewhat jittery and manual timers
 // to get the timing, but not optimal.
+//
+// Like the HardwarePinPulser, long pulses are left running while the
+// caller clocks in the next row; WaitPulseFinished() waits for the rest of
+// the time and ends them. That only works if clocking in is done before the
+// pulse should end, otherwise the pulse gets too long. So we keep track of
+// how long the caller takes between the calls, and shorter pulses are done
+// right away in SendPulse().
 class TimerBasedPinPulser : public PinPulser {
 public:
   TimerBasedPinPulser(GPIO *io, uint32_t bits,
                       const std::vector<int> &nano_specs)
-    : io_(io), bits_(bits), nano_specs_(nano_specs) {}
+    : io_(io), bits_(bits), nano_specs_(nano_specs), end_time_(-1),
+      sent_time_(-1), caller_nanos_(kInitialCallerNanos) {}
 
   virtual void SendPulse(int time_spec_number) {
+    const long nanos = nano_specs_[time_spec_number];
     io_->ClearBits(bits_);
-    Timers::sleep_nanos(nano_specs_[time_spec_number]);
+    if (nanos > caller_nanos_ + caller_nanos_ / 4 + kMarginNanos) {
+      sent_time_ = MonotonicNanos();
+      end_time_ = sent_time_ + nanos;
+    } else {
+      Timers::sleep_nanos(nanos);
+      io_->SetBits(bits_);
+      sent_time_ = MonotonicNanos();
+    }
+  }
+
+  virtual void WaitPulseFinished() {
+    if (sent_time_ < 0) return;
+    const int64_t now = MonotonicNanos();
+    // Follow increases right away, decreases slowly.
+    const int64_t caller_nanos = now - sent_time_;
+    if (caller_nanos > caller_nanos_) {
+      caller_nanos_ = caller_nanos;
+    } else {
+      caller_nanos_ -= (caller_nanos_ - caller_nanos) / 16;
+    }
+    sent_time_ = -1;
+    if (end_time_ < 0) return;
+    if (end_time_ > now) {
+      RunIdleTask(internal::GetMicrosecondCounter()
+                  + (end_time_ - now) / 1000);
+      const int64_t remaining = end_time_ - MonotonicNanos();
+      if (remaining > 0) Timers::sleep_nanos(remaining);
+    }
     io_->SetBits(bits_);
+    end_time_ = -1;
   }
 
 private:
+  // Headroom for the jitter of the caller and our timers.
+  static const int64_t kMarginNanos = 2000;
+  // Until we know better, assume the caller is slow: start with all
+  // pulses done right away.
+  static const int64_t kInitialCallerNanos = 1000000;
+
   GPIO *const io_;
   const uint32_t bits_;
   const std::vector<int> nano_specs_;
+  int64_t end_time_;      // End of the running pulse; -1 if none.
+  int64_t sent_time_;     // When SendPulse() returned; -1 if waited since.
+  int64_t caller_nanos_;  // Time the caller takes until WaitPulseFinished().
 };
 
 static volatile uint32_t *timer1Mhz = NULL;
 
-static void sleep_nanos_rpi_1(long nanos);
-static void sleep_nanos_rpi_2(long nanos);
-static void (*busy_sleep_impl)(long) = sleep_nanos_rpi_1;
+// The busy loop is calibrated against the 1Mhz timer instead of assuming
+// a CPU clock: iterations per 2^20 nanoseconds (about a millisecond).
+static const int kLoopShift = 20;
+static uint32_t loops_per_unit = 1 << kLoopShift;
+
+// Busy waits at least this long are measured with the 1Mhz timer (short
+// ones would be mostly rounding) to notice if the CPU clock changes, e.g.
+// when the CPU is throttled.
+static const long kMeasureNanos = 15000;
+// Correct the calibration after that much busy waiting was measured.
+static const long kCorrectionWindowNanos = 20000000;
+static int64_t expected_busy_nanos = 0;
+static int64_t measured_busy_nanos = 0;
+
+// Not inlined, so that it is the same loop wherever it is used.
+static void __attribute__((noinline)) busy_loop(uint32_t loops) {
+  for (uint32_t i = loops; i != 0; --i) {
+    asm volatile("");
+  }
+}
+
+// Like busy_sleep(), only used once Timers::Init() has mapped the 1Mhz
+// timer.
+static void CalibrateBusyLoop() {
+  busy_loop(1 << 22);  // Give the CPU a chance to clock up.
+  // Loops for at least 2 milliseconds; the fastest of a few tries, as we
+  // might get interrupted.
+  uint32_t loops = 1 << 16;
+  uint32_t best_micros = 0;
+  for (int i = 0; i < 5; ++i) {
+    const uint32_t start = *timer1Mhz;
+    busy_loop(loops);
+    const uint32_t micros = *timer1Mhz - start;
+    if (micros < 2000 && loops < (1U << 30)) {
+      loops *= 2;
+      --i;
+      continue;
+    }
+    if (micros > 0 && (best_micros == 0 || micros < best_micros))
+      best_micros = micros;
+  }
+  if (best_micros == 0)
+    return;  // The timer does not run; keep what we have.
+  loops_per_unit = ((uint64_t) loops << kLoopShift) / (1000ULL * best_micros);
+  if (loops_per_unit == 0) loops_per_unit = 1;
+  expected_busy_nanos = measured_busy_nanos = 0;
+}
+
+static void busy_sleep(long nanos) {
+  const uint32_t loops = ((uint64_t) nanos * loops_per_unit) >> kLoopShift;
+  if (nanos < kMeasureNanos) {
+    busy_loop(loops);
+    return;
+  }
+  const uint32_t before = *timer1Mhz;
+  busy_loop(loops);
+  const long measured = 1000L * (*timer1Mhz - before);
+  if (measured > 2 * nanos)
+    return;  // We got interrupted; says nothing about the loop.
+  expected_busy_nanos += nanos;
+  measured_busy_nanos += measured;
+  if (expected_busy_nanos < kCorrectionWindowNanos)
+    return;
+  // Only follow real changes, not the rounding of the timer.
+  const int64_t diff = measured_busy_nanos - expected_busy_nanos;
+  if (diff > expected_busy_nanos / 50 || -diff > expected_busy_nanos / 50) {
+    const uint32_t corrected = (loops_per_unit * expected_busy_nanos
+                                / measured_busy_nanos);
+    loops_per_unit = corrected > 0 ? corrected : 1;
+  }
+  expected_busy_nanos = measured_busy_nanos = 0;
+}
 
 bool Timers::Init() {
   const bool isRPi2 = IsRaspberryPi2();
@@ -222,7 +367,7 @@ bool Timers::Init() {
   }
   timer1Mhz = timereg + 1;
 
-  busy_sleep_impl = isRPi2 ? sleep_nanos_rpi_2 : sleep_nanos_rpi_1;
+  CalibrateBusyLoop();
   return true;
 }
 
@@ -252,24 +397,50 @@ void Timers::sleep_nanos(long nanos) {
     }
   }
 
-  busy_sleep_impl(nanos);
+  busy_sleep(nanos);
 }
 
-static void sleep_nanos_rpi_1(long nanos) {
-  if (nanos < 70) return;
-  // The following loop is determined empirically on a 700Mhz RPi
-  for (uint32_t i = (nanos - 70) >> 2; i != 0; --i) {
-    asm("nop");
-  }
+static int64_t MonotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
-static void sleep_nanos_rpi_2(long nanos) {
-  if (nanos < 20) return;
-  // The following loop is determined empirically on a 900Mhz RPi 2
-  for (uint32_t i = (nanos - 20) * 100 / 110; i != 0; --i) {
-    asm("");
+// A PinPulser for a GPIO with a sink. Uses the system clock for timing,
+// and like the HardwarePinPulser, returns right after starting the pulse.
+class SinkPinPulser : public PinPulser {
+public:
+  SinkPinPulser(GPIOSink *sink, uint32_t bits,
+                const std::vector<int> &nano_specs)
+    : sink_(sink), bits_(bits), nano_specs_(nano_specs), end_time_(-1) {}
+
+  virtual void SendPulse(int time_spec_number) {
+    const long nanos = nano_specs_[time_spec_number];
+    sink_->StartPulse(bits_, nanos);
+    end_time_ = MonotonicNanos() + nanos;
   }
-}
+
+  virtual void WaitPulseFinished() {
+    if (end_time_ < 0) return;
+    int64_t remaining = end_time_ - MonotonicNanos();
+    if (remaining > 0)
+      RunIdleTask(internal::GetMicrosecondCounter() + remaining / 1000);
+    while ((remaining = end_time_ - MonotonicNanos()) > 0) {
+      if (remaining > 30000) {
+        struct timespec sleep_time = { 0, remaining - 25000 };
+        nanosleep(&sleep_time, NULL);
+      }
+    }
+    sink_->SetBits(bits_);
+    end_time_ = -1;
+  }
+
+private:
+  GPIOSink *const sink_;
+  const uint32_t bits_;
+  const std::vector<int> nano_specs_;
+  int64_t end_time_;   // End of the current pulse; -1 if none.
+};
 
 // A PinPulser that uses the PWM hardware to create accurate pulses.
 // It only works on GPIO-18 though.
@@ -283,6 +454,7 @@ public:
     for (size_t i = 0; i < specs.size(); ++i) {
       sleep_hints_.push_back(specs[i] / 1000);
     }
+    // The first pulse determines the resolution; none is shorter.
     const int base = specs[0];
     // Get relevant registers
     const bool isPI2 = IsRaspberryPi2();
@@ -319,6 +491,11 @@ public:
       *fifo_ = pwm_range_[c] / 8;
       *fifo_ = pwm_range_[c] / 8;
       *fifo_ = pwm_range_[c] / 8;
+      // Remainder if not evenly divisible (only scaled down pulses), as
+      // far as the hardware can do it.
+      if (pwm_range_[c] % 8 >= 2) {
+        *fifo_ = pwm_range_[c] % 8;
+      }
     }
 
     /*
@@ -347,6 +524,7 @@ public:
     // Determine how long we already spent and sleep to get close to the
     // actual end-time of our sleep period.
     // (substract 25 usec, as this is the OS overhead).
+    RunIdleTask(start_time_ + sleep_hint_);
     const uint32_t elapsed_usec = *timer1Mhz - start_time_;
     const int to_sleep = sleep_hint_ - elapsed_usec - 25;
     if (to_sleep > 0) {
@@ -396,10 +574,36 @@ private:
 
 } // end anonymous namespace
 
+uint32_t internal::GetMicrosecondCounter() {
+  if (timer1Mhz != NULL)
+    return *timer1Mhz;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t) ((uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+// Leave some time to wake up from the idle task: one step of it might
+// take a little longer than planned.
+static const int kIdleMarginUsec = 10;
+// Shorter gaps are not worth it.
+static const int kMinIdleUsec = 20;
+
+void PinPulser::RunIdleTask(uint32_t end_usec) {
+  if (idle_task_ == NULL) return;
+  const uint32_t deadline = end_usec - kIdleMarginUsec;
+  while ((int32_t) (deadline - internal::GetMicrosecondCounter())
+         >= kMinIdleUsec) {
+    if (!idle_task_->RunUntil(deadline))
+      break;
+  }
+}
+
 // Public PinPulser factory
 PinPulser *PinPulser::Create(GPIO *io, uint32_t gpio_mask,
                              const std::vector<int> &nano_wait_spec) {
-  // The only implementation so far.
+  if (io->sink() != NULL) {
+    return new SinkPinPulser(io->sink(), gpio_mask, nano_wait_spec);
+  }
   if (!Timers::Init()) return NULL;
   if (HardwarePinPulser::CanHandle(gpio_mask)) {
     return new HardwarePinPulser(gpio_mask, nano_wait_spec);
@@ -64,9 +64,15 @@ void DrawLine(Canvas *c, int x0, int y0, int x1, int y1, const Color &color) {
       std::swap(y0, y1);
     }
     gradient = (dy << shift) / dx ;
-    
+
+    // Draw runs of pixels on the same row at once.
+    int run_start = x0;
     for (x = x0 , y = 0x8000 + (y0 << shift); x <= x1; ++x, y += gradient) {
-      c->SetPixel(x, y >> shift, color.r, color.g, color.b);
+      if (x == x1 || ((y + gradient) >> shift) != (y >> shift)) {
+        c->DrawHLine(run_start, y >> shift, x - run_start + 1,
+                     color.r, color.g, color.b);
+        run_start = x + 1;
+      }
     }
   } else if (dy != 0) {
     // y variation is bigger than x variation
@@ -75,8 +81,13 @@ void DrawLine(Canvas *c, int x0, int y0, int x1, int y1, const Color &color) {
       std::swap(y0, y1);
     }
     gradient = (dx << shift) / dy;
+    int run_start = y0;
     for (y = y0 , x = 0x8000 + (x0 << shift); y <= y1; ++y, x += gradient) {
-      c->SetPixel(x >> shift, y, color.r, color.g, color.b);
+      if (y == y1 || ((x + gradient) >> shift) != (x >> shift)) {
+        c->FillRect(x >> shift, run_start, 1, y - run_start + 1,
+                    color.r, color.g, color.b);
+        run_start = y + 1;
+      }
     }
   } else {
     c->SetPixel(x0, y0, color.r, color.g, color.b);
@@ -23,12 +23,11 @@
 #include <string.h>
 #include <time.h>
 
-#ifdef SHOW_REFRESH_RATE
-# include <stdio.h>
-# include <sys/time.h>
-#endif
+#include <algorithm>
+#include <vector>
 
 #include "gpio.h"
+#include "gpio-internal.h"
 #include "thread.h"
 #include "framebuffer-internal.h"
 
@@ -39,15 +38,186 @@ class NullTransformer : public CanvasTransformer {
 public:
   virtual Canvas *Transform(Canvas *output) { return output; }
 };
+
+// Canvas that remembers where pixels set on it end up. Used to find out
+// what a transformer does with each pixel.
+class ProbeCanvas : public Canvas {
+public:
+  ProbeCanvas(int width, int height)
+    : width_(width), height_(height), hits_(0), x_(-1), y_(-1) {}
+
+  void Reset() { hits_ = 0; }
+  int hits() const { return hits_; }
+  int x() const { return x_; }
+  int y() const { return y_; }
+
+  virtual int width() const { return width_; }
+  virtual int height() const { return height_; }
+  virtual void SetPixel(int x, int y, uint8_t, uint8_t, uint8_t) {
+    if (x < 0 || x >= width_ || y < 0 || y >= height_) return;
+    ++hits_;
+    x_ = x;
+    y_ = y;
+  }
+  virtual void Clear() {}
+  virtual void Fill(uint8_t, uint8_t, uint8_t) {}
+
+private:
+  const int width_;
+  const int height_;
+  int hits_;
+  int x_, y_;
+};
 }  // anonymous namespace
 
+// A transformer flattened into a table with the framebuffer position of
+// each pixel of the transformed canvas. See CompileTransformer().
+class RGBMatrix::CompiledTransformer : public CanvasTransformer {
+public:
+  // Returns NULL if "transformer" can't be represented by a table.
+  static CompiledTransformer *Create(CanvasTransformer *transformer,
+                                     FrameCanvas *frame) {
+    ProbeCanvas probe(frame->width(), frame->height());
+    Canvas *const transformed = transformer->Transform(&probe);
+    const int width = transformed->width();
+    const int height = transformed->height();
+    std::vector<uint32_t> map(width * height);
+    bool one_to_one = true;
+    for (int y = 0; one_to_one && y < height; ++y) {
+      for (int x = 0; x < width; ++x) {
+        probe.Reset();
+        transformed->SetPixel(x, y, 0xff, 0xff, 0xff);
+        if (probe.hits() > 1) {
+          one_to_one = false;
+          break;
+        }
+        map[y * width + x] = (probe.hits() == 0)
+          ? internal::Framebuffer::kInvalidPixelPosition
+          : frame->framebuffer()->PixelPosition(probe.x(), probe.y());
+      }
+    }
+    // The transformer keeps the canvas it transformed; don't leave it
+    // with the probe that is gone after this.
+    transformer->Transform(frame);
+    if (!one_to_one) return NULL;
+    return new CompiledTransformer(transformer, frame, width, height, &map);
+  }
+
+  CanvasTransformer *original() { return original_; }
+  int width() const { return width_; }
+  int height() const { return height_; }
+
+  inline void SetPixel(internal::Framebuffer *frame, int x, int y,
+                       uint8_t red, uint8_t green, uint8_t blue) {
+    if ((unsigned) x >= (unsigned) width_ || (unsigned) y >= (unsigned) height_)
+      return;
+    const uint32_t pos = map_[y * width_ + x];
+    if (pos != internal::Framebuffer::kInvalidPixelPosition)
+      frame->SetPixelAt(pos, red, green, blue);
+  }
+
+  void FillRect(internal::Framebuffer *frame, int x, int y, int w, int h,
+                uint8_t red, uint8_t green, uint8_t blue) {
+    if (!Clip(&x, &y, &w, &h, NULL, 0)) return;
+    for (int row = y; row < y + h; ++row) {
+      const uint32_t *pos = &map_[row * width_ + x];
+      for (int col = 0; col < w; ++col, ++pos) {
+        if (*pos != internal::Framebuffer::kInvalidPixelPosition)
+          frame->SetPixelAt(*pos, red, green, blue);
+      }
+    }
+  }
+
+  void CopyRect(internal::Framebuffer *frame, int x, int y, int w, int h,
+                const uint8_t *rgb, int stride) {
+    if (!Clip(&x, &y, &w, &h, &rgb, stride)) return;
+    for (int row = y; row < y + h; ++row, rgb += stride) {
+      const uint32_t *pos = &map_[row * width_ + x];
+      const uint8_t *pixel = rgb;
+      for (int col = 0; col < w; ++col, ++pos, pixel += 3) {
+        if (*pos != internal::Framebuffer::kInvalidPixelPosition)
+          frame->SetPixelAt(*pos, pixel[0], pixel[1], pixel[2]);
+      }
+    }
+  }
+
+  virtual Canvas *Transform(Canvas *output) {
+    FrameCanvas *const frame = dynamic_cast<FrameCanvas*>(output);
+    if (frame == NULL || frame->width() != frame_width_
+        || frame->height() != frame_height_) {
+      return original_->Transform(output);   // Not one of ours.
+    }
+    canvas_.frame_ = frame;
+    return &canvas_;
+  }
+
+private:
+  // Clip rectangle to our size; adjust "rgb" if given. Returns false if
+  // nothing is left.
+  bool Clip(int *x, int *y, int *w, int *h,
+            const uint8_t **rgb, int stride) const {
+    if (*x < 0) { if (rgb) *rgb -= 3 * *x; *w += *x; *x = 0; }
+    if (*y < 0) { if (rgb) *rgb -= stride * *y; *h += *y; *y = 0; }
+    if (*x + *w > width_) *w = width_ - *x;
+    if (*y + *h > height_) *h = height_ - *y;
+    return *w > 0 && *h > 0;
+  }
+
+  class MappedCanvas : public Canvas {
+  public:
+    MappedCanvas(CompiledTransformer *parent) : parent_(parent), frame_(NULL) {}
+    virtual int width() const { return parent_->width(); }
+    virtual int height() const { return parent_->height(); }
+    virtual void SetPixel(int x, int y,
+                          uint8_t red, uint8_t green, uint8_t blue) {
+      parent_->SetPixel(frame_->framebuffer(), x, y, red, green, blue);
+    }
+    virtual void Clear() { frame_->Clear(); }
+    virtual void Fill(uint8_t red, uint8_t green, uint8_t blue) {
+      frame_->Fill(red, green, blue);
+    }
+    virtual void FillRect(int x, int y, int w, int h,
+                          uint8_t red, uint8_t green, uint8_t blue) {
+      parent_->FillRect(frame_->framebuffer(), x, y, w, h, red, green, blue);
+    }
+    virtual void CopyRect(int x, int y, int w, int h,
+                          const uint8_t *rgb, int stride) {
+      parent_->CopyRect(frame_->framebuffer(), x, y, w, h, rgb, stride);
+    }
+
+    CompiledTransformer *const parent_;
+    FrameCanvas *frame_;
+  };
+
+  CompiledTransformer(CanvasTransformer *original, FrameCanvas *frame,
+                      int width, int height, std::vector<uint32_t> *map)
+    : original_(original),
+      frame_width_(frame->width()), frame_height_(frame->height()),
+      width_(width), height_(height), canvas_(this) {
+    map_.swap(*map);
+  }
+
+  CanvasTransformer *const original_;
+  const int frame_width_;
+  const int frame_height_;
+  const int width_;
+  const int height_;
+  std::vector<uint32_t> map_;  // [y * width + x]: Framebuffer position.
+  MappedCanvas canvas_;
+};
+
 // Pump pixels to screen. Needs to be high priority real-time because jitter
-class RGBMatrix::UpdateThread : public Thread {
+class RGBMatrix::UpdateThread : public Thread, public IdleTask {
 public:
   UpdateThread(GPIO *io, FrameCanvas *initial_frame)
     : io_(io), running_(true),
-      current_frame_(initial_frame), next_frame_(NULL) {
+      current_frame_(initial_frame), next_frame_(NULL),
+      compile_next_frame_(false), swap_requested_(false), mailbox_(0),
+      refreshes_(0), refresh_waiters_(0),
+      deadline_usec_(0), subframes_(1), reset_stats_(false) {
     pthread_cond_init(&frame_done_, NULL);
+    memset(&accounting_, 0, sizeof(accounting_));
+    memset(&published_, 0, sizeof(published_));
   }
 
   void Stop() {
@@ -56,46 +226,217 @@ public:
   }
 
   virtual void Run() {
+    internal::Framebuffer::SetIdleTask(this);
+    uint32_t frame_start = internal::GetMicrosecondCounter();
     while (running()) {
-#ifdef SHOW_REFRESH_RATE
-      struct timeval start, end;
-      gettimeofday(&start, NULL);
-#endif
-
-      current_frame_->framebuffer()->DumpToMatrix(io_);
+      internal::Framebuffer::DumpTiming timing = { 0, 0 };
+      current_frame_->framebuffer()
+        ->DumpToMatrix(io_, &timing,
+                       __atomic_load_n(&subframes_, __ATOMIC_RELAXED));
+      bool swapped = false;
+
+      // Newest frame from SubmitFrame() waiting ? Take it and leave the
+      // one we have shown in the mailbox for the producer to reuse.
+      if (__atomic_load_n(&mailbox_, __ATOMIC_ACQUIRE) & kNewFrame) {
+        const uintptr_t newest
+          = __atomic_exchange_n(&mailbox_, (uintptr_t) current_frame_,
+                                __ATOMIC_ACQ_REL);
+        // SwapOnVSync() might read it.
+        __atomic_store_n(&current_frame_,
+                         (FrameCanvas*) (newest & ~kNewFrame),
+                         __ATOMIC_RELEASE);
+        swapped = true;
+      }
 
-      {
+      // Only take the lock if someone is waiting in SwapOnVSync().
+      if (__atomic_load_n(&swap_requested_, __ATOMIC_ACQUIRE)) {
         MutexLock l(&frame_sync_);
-        if (next_frame_ != NULL) {
-          current_frame_ = next_frame_;
+        // If RunUntil() did not get to compile all of it, SwapOnVSync()
+        // does the rest and asks again.
+        if (next_frame_ != NULL && !compile_next_frame_) {
+          __atomic_store_n(&current_frame_, next_frame_, __ATOMIC_RELEASE);
           next_frame_ = NULL;
+          swapped = true;
         }
-        pthread_cond_signal(&frame_done_);
+        swap_requested_ = false;
+        pthread_cond_broadcast(&frame_done_);
+      }
+
+      // Only take the lock if someone is waiting in WaitForRefresh().
+      __atomic_add_fetch(&refreshes_, 1, __ATOMIC_SEQ_CST);
+      if (__atomic_load_n(&refresh_waiters_, __ATOMIC_SEQ_CST) > 0) {
+        MutexLock l(&frame_sync_);
+        pthread_cond_broadcast(&frame_done_);
       }
 
-#ifdef SHOW_REFRESH_RATE
-      gettimeofday(&end, NULL);
-      int64_t usec = ((uint64_t)end.tv_sec * 1000000 + end.tv_usec)
-        - ((int64_t)start.tv_sec * 1000000 + start.tv_usec);
-      printf("\b\b\b\b\b\b\b\b%6.1fHz", 1e6 / usec);
-#endif
+      const uint32_t frame_end = internal::GetMicrosecondCounter();
+      CountFrame(frame_end - frame_start, timing, swapped);
+      frame_start = frame_end;
     }
+    internal::Framebuffer::SetIdleTask(NULL);
   }
 
-  FrameCanvas *SwapOnVSync(FrameCanvas *other) {
+  // While waiting for the output-enable pulses: compile the frame that is
+  // waiting in SwapOnVSync(). Nobody else touches it until the swap.
+  virtual bool RunUntil(uint32_t deadline_usec) {
+    if (!__atomic_load_n(&swap_requested_, __ATOMIC_ACQUIRE)
+        || !compile_next_frame_)
+      return false;
+    if (next_frame_->framebuffer()->CompileUntil(deadline_usec))
+      compile_next_frame_ = false;
+    return compile_next_frame_;
+  }
+
+  // With "compile", "other" is compiled before it is shown: mostly by the
+  // refresh thread while it waits anyway, but never while it should
+  // refresh.
+  FrameCanvas *SwapOnVSync(FrameCanvas *other, bool compile = false) {
     MutexLock l(&frame_sync_);
-    FrameCanvas *previous = current_frame_;
+    FrameCanvas *previous = __atomic_load_n(&current_frame_, __ATOMIC_ACQUIRE);
     next_frame_ = other;
-    frame_sync_.WaitOn(&frame_done_);
+    compile_next_frame_ = compile && other != NULL;
+    __atomic_store_n(&swap_requested_, true, __ATOMIC_RELEASE);
+    while (swap_requested_) {
+      frame_sync_.WaitOn(&frame_done_);
+    }
+    if (compile_next_frame_) {
+      // Not swapped: the refresh thread did not have enough time. Do the
+      // rest here and swap at the next VSync. It does not take the lock
+      // while no swap is requested.
+      next_frame_->framebuffer()->Compile();
+      compile_next_frame_ = false;
+      __atomic_store_n(&swap_requested_, true, __ATOMIC_RELEASE);
+      while (swap_requested_) {
+        frame_sync_.WaitOn(&frame_done_);
+      }
+    }
     return previous;
   }
 
+  // Wait until a full refresh that started after this call is done, e.g.
+  // to know that replaced bitplanes are not used anymore. Works with both
+  // SwapOnVSync() and SubmitFrame().
+  void WaitForRefresh() {
+    MutexLock l(&frame_sync_);
+    __atomic_add_fetch(&refresh_waiters_, 1, __ATOMIC_SEQ_CST);
+    // The refresh running right now might have started before.
+    const uint32_t target
+      = __atomic_load_n(&refreshes_, __ATOMIC_SEQ_CST) + 2;
+    while ((int32_t) (__atomic_load_n(&refreshes_, __ATOMIC_SEQ_CST)
+                      - target) < 0) {
+      frame_sync_.WaitOn(&frame_done_);
+    }
+    __atomic_sub_fetch(&refresh_waiters_, 1, __ATOMIC_SEQ_CST);
+  }
+
+  // If "frame" is being displayed, or waiting to be in the mailbox or in
+  // SwapOnVSync().
+  bool Holds(FrameCanvas *frame) {
+    if (__atomic_load_n(&current_frame_, __ATOMIC_ACQUIRE) == frame)
+      return true;
+    if ((FrameCanvas*) (__atomic_load_n(&mailbox_, __ATOMIC_ACQUIRE)
+                        & ~kNewFrame) == frame)
+      return true;
+    MutexLock l(&frame_sync_);
+    return next_frame_ == frame;
+  }
+
+  // Put "other" in the mailbox and return what was in there before: either
+  // a frame that has never been shown or the frame the refresh thread
+  // replaced. NULL if the mailbox has not been used yet.
+  FrameCanvas *SubmitFrame(FrameCanvas *other) {
+    const uintptr_t previous
+      = __atomic_exchange_n(&mailbox_, (uintptr_t) other | kNewFrame,
+                            __ATOMIC_ACQ_REL);
+    return (FrameCanvas*) (previous & ~kNewFrame);
+  }
+
+  void GetStats(RefreshStats *stats) {
+    Accounting snapshot;
+    {
+      MutexLock l(&stats_mutex_);
+      snapshot = published_;
+    }
+    *stats = snapshot.stats;
+    stats->row_switch_usec = (stats->total_usec
+                              - stats->clocking_usec - stats->waiting_usec);
+    // Percentile from the frame time histogram. If it is beyond the range
+    // of the histogram, all we know is the maximum.
+    const uint64_t p99_count = stats->frames - stats->frames / 100;
+    uint64_t count = 0;
+    stats->p99_frame_usec = stats->max_frame_usec;
+    for (int i = 0; i < kFrameBuckets - 1; ++i) {
+      count += snapshot.frame_histogram[i];
+      if (count >= p99_count && count > 0) {
+        stats->p99_frame_usec = (i + 1) * kFrameBucketUsec;
+        if (stats->p99_frame_usec > stats->max_frame_usec)
+          stats->p99_frame_usec = stats->max_frame_usec;
+        break;
+      }
+    }
+  }
+
+  void ResetStats() { __atomic_store_n(&reset_stats_, true, __ATOMIC_RELEASE); }
+  void SetDeadline(int usec) {
+    __atomic_store_n(&deadline_usec_, usec, __ATOMIC_RELAXED);
+  }
+  void SetSubframes(int count) {
+    __atomic_store_n(&subframes_, count, __ATOMIC_RELAXED);
+  }
+
 private:
+  // Histogram of frame times to determine percentiles.
+  enum {
+    kFrameBuckets = 512,
+    kFrameBucketUsec = 50
+  };
+
+  struct Accounting {
+    RefreshStats stats;
+    uint32_t frame_histogram[kFrameBuckets];
+  };
+
+  // Count a frame. Called in the refresh thread, so we never block: the
+  // stats are published for GetStats() whenever the lock is free.
+  void CountFrame(uint32_t usec, const internal::Framebuffer::DumpTiming &t,
+                  bool swapped) {
+    if (__atomic_load_n(&reset_stats_, __ATOMIC_ACQUIRE)) {
+      memset(&accounting_, 0, sizeof(accounting_));
+      __atomic_store_n(&reset_stats_, false, __ATOMIC_RELEASE);
+    }
+    RefreshStats *const stats = &accounting_.stats;
+    stats->frames++;
+    if (swapped) stats->swaps++;
+    if ((int) usec > __atomic_load_n(&deadline_usec_, __ATOMIC_RELAXED))
+      stats->missed_deadlines++;
+    if (usec > stats->max_frame_usec) stats->max_frame_usec = usec;
+    stats->total_usec += usec;
+    stats->clocking_usec += t.clocking;
+    stats->waiting_usec += t.waiting;
+
+    const uint32_t frame_bucket = usec / kFrameBucketUsec;
+    accounting_.frame_histogram[frame_bucket < kFrameBuckets
+                                ? frame_bucket : kFrameBuckets - 1]++;
+    const uint32_t rate_bucket = (usec > 0)
+      ? 1000000 / usec / RefreshStats::kRateBucketHz
+      : RefreshStats::kRateBuckets;
+    stats->rate_histogram[rate_bucket < RefreshStats::kRateBuckets
+                          ? rate_bucket : RefreshStats::kRateBuckets - 1]++;
+
+    if (stats_mutex_.TryLock()) {
+      published_ = accounting_;
+      stats_mutex_.Unlock();
+    }
+  }
+
   inline bool running() {
     MutexLock l(&running_mutex_);
     return running_;
   }
 
+  // Tag in the mailbox: the frame in there has not been shown yet.
+  static const uintptr_t kNewFrame = 1;
+
   GPIO *const io_;
   Mutex running_mutex_;
   bool running_;
@@ -104,13 +445,29 @@ private:
   pthread_cond_t frame_done_;
   FrameCanvas *current_frame_;
   FrameCanvas *next_frame_;
+  bool compile_next_frame_;
+  bool swap_requested_;
+
+  uintptr_t mailbox_;  // FrameCanvas*, tagged with kNewFrame.
+
+  uint32_t refreshes_;      // Count of refreshes done.
+  int refresh_waiters_;     // Threads in WaitForRefresh().
+
+  int deadline_usec_;
+  int subframes_;
+  bool reset_stats_;
+  Accounting accounting_;  // Only accessed by the refresh thread.
+  Mutex stats_mutex_;
+  Accounting published_;   // Copy of accounting_ for GetStats().
 };
 
 RGBMatrix::RGBMatrix(GPIO *io, int rows, int chained_displays,
                      int parallel_displays)
   : rows_(rows), chained_displays_(chained_displays),
-    parallel_displays_(parallel_displays),
-    io_(NULL), updater_(NULL) {
+    parallel_displays_(parallel_displays), compile_frames_(false),
+    auto_pwm_bits_(false),
+    refresh_deadline_usec_(10000), subframes_(1), io_(NULL), updater_(NULL),
+    compiled_transformer_(NULL) {
   SetTransformer(NULL);
   active_ = CreateFrameCanvas();
   Clear();
@@ -118,17 +475,20 @@ RGBMatrix::RGBMatrix(GPIO *io, int rows, int chained_displays,
 }
 
 RGBMatrix::~RGBMatrix() {
-  updater_->Stop();
-  updater_->WaitStopped();
-  delete updater_;
-
-  // Make sure LEDs are off.
-  active_->Clear();
-  active_->framebuffer()->DumpToMatrix(io_);
+  if (updater_ != NULL) {   // Only if we ever had GPIO.
+    updater_->Stop();
+    updater_->WaitStopped();
+    delete updater_;
+
+    // Make sure LEDs are off.
+    active_->Clear();
+    active_->framebuffer()->DumpToMatrix(io_);
+  }
 
   for (size_t i = 0; i < created_frames_.size(); ++i) {
     delete created_frames_[i];
   }
+  delete compiled_transformer_;
 }
 
 void RGBMatrix::SetGPIO(GPIO *io) {
@@ -137,6 +497,8 @@ void RGBMatrix::SetGPIO(GPIO *io) {
   io_ = io;
   internal::Framebuffer::InitGPIO(io_, parallel_displays_);
   updater_ = new UpdateThread(io_, active_);
+  updater_->SetDeadline(refresh_deadline_usec_);
+  updater_->SetSubframes(subframes_);
   // If we have multiple processors, the kernel
   // jumps around between these, creating some global flicker.
   // So let's tie it to the last CPU available.
@@ -148,16 +510,22 @@ void RGBMatrix::SetGPIO(GPIO *io) {
 }
 
 FrameCanvas *RGBMatrix::CreateFrameCanvas() {
-  FrameCanvas *result =
-    new FrameCanvas(new internal::Framebuffer(rows_, 32 * chained_displays_,
-                                              parallel_displays_));
+  FrameCanvas *result;
   if (created_frames_.empty()) {
     // First time. Get defaults from initial Framebuffer.
+    result = new FrameCanvas(
+      new internal::Framebuffer(rows_, 32 * chained_displays_,
+                                parallel_displays_));
     pwm_bits_ = result->framebuffer()->pwmbits();
+    dither_bits_ = result->framebuffer()->ditherbits();
     do_luminance_correct_ = result->framebuffer()->luminance_correct();
     brightness_ = result->framebuffer()->brightness();
   } else {
-    result->framebuffer()->SetPWMBits(pwm_bits_);
+    // Only allocate the bitplanes in use.
+    result = new FrameCanvas(
+      new internal::Framebuffer(rows_, 32 * chained_displays_,
+                                parallel_displays_,
+                                pwm_bits_, dither_bits_));
     result->framebuffer()->set_luminance_correct(do_luminance_correct_);
     result->framebuffer()->SetBrightness(brightness_);
   }
@@ -165,13 +533,113 @@ FrameCanvas *RGBMatrix::CreateFrameCanvas() {
   return result;
 }
 
+void RGBMatrix::ReserveFrameCanvases(int count) {
+  while ((int) free_frames_.size() < count) {
+    free_frames_.push_back(CreateFrameCanvas());  // Clear()ed: all touched.
+  }
+}
+
+FrameCanvas *RGBMatrix::AcquireFrameCanvas() {
+  if (free_frames_.empty()) {
+    return CreateFrameCanvas();
+  }
+  FrameCanvas *const result = free_frames_.back();
+  free_frames_.pop_back();
+  // Settings might have changed since it was created.
+  internal::Framebuffer *const frame = result->framebuffer();
+  frame->SetPWMBits(pwm_bits_);
+  frame->SetDitherBits(dither_bits_);
+  frame->FreeRetiredPlanes();  // Not displayed.
+  frame->set_luminance_correct(do_luminance_correct_);
+  frame->SetBrightness(brightness_);
+  frame->Clear();
+  return result;
+}
+
+bool RGBMatrix::ReleaseFrameCanvas(FrameCanvas *canvas) {
+  if (canvas == NULL || canvas == active_)
+    return false;
+  if (std::find(created_frames_.begin(), created_frames_.end(), canvas)
+      == created_frames_.end())
+    return false;  // Not ours, e.g. from another matrix or an archive.
+  if (std::find(free_frames_.begin(), free_frames_.end(), canvas)
+      != free_frames_.end())
+    return false;  // Released before.
+  if (updater_ != NULL && updater_->Holds(canvas))
+    return false;
+  free_frames_.push_back(canvas);
+  return true;
+}
+
 FrameCanvas *RGBMatrix::SwapOnVSync(FrameCanvas *other) {
-  FrameCanvas *const previous = updater_->SwapOnVSync(other);
+  if (updater_ == NULL) {  // No GPIO yet: nothing to wait for.
+    FrameCanvas *const previous = active_;
+    if (other) active_ = other;
+    return previous;
+  }
+  if (other) other->framebuffer()->Analyze(auto_pwm_bits_);
+  // Compiled by the refresh thread in the meantime; it must not allocate.
+  if (other && compile_frames_) other->framebuffer()->ReserveCompiled();
+  FrameCanvas *const previous = updater_->SwapOnVSync(other, compile_frames_);
   if (other) active_ = other;
+  // Not displayed anymore or has been fully refreshed since.
+  previous->framebuffer()->FreeRetiredPlanes();
   return previous;
 }
 
+FrameCanvas *RGBMatrix::SwapOnVSyncKeepContent(FrameCanvas *other) {
+  FrameCanvas *const previous = SwapOnVSync(other);
+  if (other != NULL && previous != other) {
+    previous->CopyFrom(*other);
+    previous->framebuffer()->FreeRetiredPlanes();  // In case PWM bits differ.
+  }
+  return previous;
+}
+
+FrameCanvas *RGBMatrix::SubmitFrame(FrameCanvas *other) {
+  other->framebuffer()->Analyze(auto_pwm_bits_);
+  if (compile_frames_) other->framebuffer()->Compile();
+  FrameCanvas *free_frame = updater_->SubmitFrame(other);
+  active_ = other;
+  if (free_frame == NULL) {
+    // First use; we need a third buffer to hand out.
+    free_frame = CreateFrameCanvas();
+  }
+  free_frame->framebuffer()->FreeRetiredPlanes();  // Not displayed.
+  return free_frame;
+}
+
+void RGBMatrix::GetStats(RefreshStats *stats) {
+  if (updater_ == NULL) {
+    memset(stats, 0, sizeof(*stats));
+    return;
+  }
+  updater_->GetStats(stats);
+}
+
+void RGBMatrix::ResetStats() {
+  if (updater_) updater_->ResetStats();
+}
+
+void RGBMatrix::SetRefreshDeadline(int usec) {
+  refresh_deadline_usec_ = usec;
+  if (updater_) updater_->SetDeadline(usec);
+}
+
+bool RGBMatrix::SetSubframes(int count) {
+  if (count < 1 || count > internal::Framebuffer::kMaxSubframes
+      || (count & (count - 1)) != 0)
+    return false;
+  subframes_ = count;
+  if (updater_) updater_->SetSubframes(count);
+  return true;
+}
+
 void RGBMatrix::SetTransformer(CanvasTransformer *transformer) {
+  if (transformer != NULL && transformer == compiled_transformer_)
+    return;  // Already set.
+  delete compiled_transformer_;
+  compiled_transformer_ = NULL;
   if (transformer == NULL) {
     static NullTransformer null_transformer;   // global instance sufficient.
     transformer_ = &null_transformer;
@@ -180,15 +648,43 @@ void RGBMatrix::SetTransformer(CanvasTransformer *transformer) {
   }
 }
 
+bool RGBMatrix::CompileTransformer() {
+  CanvasTransformer *const original = (compiled_transformer_ != NULL)
+    ? compiled_transformer_->original()
+    : transformer_;
+  CompiledTransformer *const compiled
+    = CompiledTransformer::Create(original, active_);
+  if (compiled == NULL) return false;
+  delete compiled_transformer_;
+  compiled_transformer_ = compiled;
+  transformer_ = compiled;
+  return true;
+}
+
 bool RGBMatrix::SetPWMBits(uint8_t value) {
   const bool success = active_->framebuffer()->SetPWMBits(value);
   if (success) {
     pwm_bits_ = value;
+    dither_bits_ = active_->framebuffer()->ditherbits();  // Might be less.
+    // After the next refresh, the previous bitplanes are not used anymore.
+    if (updater_) updater_->WaitForRefresh();
+    active_->framebuffer()->FreeRetiredPlanes();
   }
   return success;
 }
 uint8_t RGBMatrix::pwmbits() { return pwm_bits_; }
 
+bool RGBMatrix::SetDitherBits(uint8_t value) {
+  const bool success = active_->framebuffer()->SetDitherBits(value);
+  if (success) {
+    dither_bits_ = value;
+    if (updater_) updater_->WaitForRefresh();
+    active_->framebuffer()->FreeRetiredPlanes();
+  }
+  return success;
+}
+uint8_t RGBMatrix::ditherbits() { return dither_bits_; }
+
 // Map brightness of output linearly to input with CIE1931 profile.
 void RGBMatrix::set_luminance_correct(bool on) {
   active_->framebuffer()->set_luminance_correct(on);
@@ -207,16 +703,43 @@ uint8_t RGBMatrix::brightness() {
   return brightness_;
 }
 
+/* static */ bool RGBMatrix::SetHardwareMapping(const char *name) {
+  return internal::Framebuffer::SetHardwareMapping(name);
+}
+
+/* static */ const char *RGBMatrix::hardware_mapping() {
+  return internal::Framebuffer::hardware_mapping();
+}
+
+/* static */ bool RGBMatrix::SetInverseColors(bool on) {
+  return internal::Framebuffer::SetInverseColors(on);
+}
+
+void RGBMatrix::SetOutputBrightness(uint8_t brightness) {
+  internal::Framebuffer::SetOutputBrightness(brightness);
+}
+
+uint8_t RGBMatrix::output_brightness() {
+  return internal::Framebuffer::output_brightness();
+}
+
 // -- Implementation of RGBMatrix Canvas: delegation to ContentBuffer
 int RGBMatrix::width() const {
+  if (compiled_transformer_) return compiled_transformer_->width();
   return transformer_->Transform(active_)->width();
 }
 
 int RGBMatrix::height() const {
+  if (compiled_transformer_) return compiled_transformer_->height();
   return transformer_->Transform(active_)->height();
 }
 
 void RGBMatrix::SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue) {
+  if (compiled_transformer_) {
+    compiled_transformer_->SetPixel(active_->framebuffer(),
+                                    x, y, red, green, blue);
+    return;
+  }
   transformer_->Transform(active_)->SetPixel(x, y, red, green, blue);
 }
 
@@ -228,6 +751,27 @@ void RGBMatrix::Fill(uint8_t red, uint8_t green, uint8_t blue) {
   transformer_->Transform(active_)->Fill(red, green, blue);
 }
 
+void RGBMatrix::FillRect(int x, int y, int width, int height,
+                         uint8_t red, uint8_t green, uint8_t blue) {
+  if (compiled_transformer_) {
+    compiled_transformer_->FillRect(active_->framebuffer(),
+                                    x, y, width, height, red, green, blue);
+    return;
+  }
+  transformer_->Transform(active_)->FillRect(x, y, width, height,
+                                             red, green, blue);
+}
+
+void RGBMatrix::CopyRect(int x, int y, int width, int height,
+                         const uint8_t *rgb, int stride) {
+  if (compiled_transformer_) {
+    compiled_transformer_->CopyRect(active_->framebuffer(),
+                                    x, y, width, height, rgb, stride);
+    return;
+  }
+  transformer_->Transform(active_)->CopyRect(x, y, width, height, rgb, stride);
+}
+
 // FrameCanvas implementation of Canvas
 FrameCanvas::~FrameCanvas() { delete frame_; }
 int FrameCanvas::width() const { return frame_->width(); }
@@ -240,8 +784,37 @@ void FrameCanvas::Clear() { return frame_->Clear(); }
 void FrameCanvas::Fill(uint8_t red, uint8_t green, uint8_t blue) {
   frame_->Fill(red, green, blue);
 }
+void FrameCanvas::FillRect(int x, int y, int width, int height,
+                           uint8_t red, uint8_t green, uint8_t blue) {
+  frame_->FillRect(x, y, width, height, red, green, blue);
+}
+void FrameCanvas::CopyRect(int x, int y, int width, int height,
+                           const uint8_t *rgb, int stride) {
+  frame_->SetPixels(x, y, width, height, rgb, stride);
+}
+void FrameCanvas::SetPixels(int x, int y, int width, int height,
+                            const uint8_t *rgb, int stride) {
+  frame_->SetPixels(x, y, width, height, rgb, stride);
+}
 bool FrameCanvas::SetPWMBits(uint8_t value) { return frame_->SetPWMBits(value); }
 uint8_t FrameCanvas::pwmbits() { return frame_->pwmbits(); }
+bool FrameCanvas::SetDitherBits(uint8_t value) { return frame_->SetDitherBits(value); }
+uint8_t FrameCanvas::ditherbits() { return frame_->ditherbits(); }
+void FrameCanvas::SetShadowBuffer(bool on) { frame_->SetShadowBuffer(on); }
+bool FrameCanvas::has_shadow_buffer() const {
+  return frame_->has_shadow_buffer();
+}
+bool FrameCanvas::GetPixel(int x, int y,
+                           uint8_t *red, uint8_t *green, uint8_t *blue) {
+  return frame_->GetPixel(x, y, red, green, blue);
+}
+bool FrameCanvas::CopyFrom(const FrameCanvas &other) {
+  return frame_->CopyFrom(*other.frame_);
+}
+bool FrameCanvas::CopyFrom(const FrameCanvas &other,
+                           int x, int y, int width, int height) {
+  return frame_->CopyFrom(*other.frame_, x, y, width, height);
+}
 
 // Map brightness of output linearly to input with CIE1931 profile.
 void FrameCanvas::set_luminance_correct(bool on) { frame_->set_luminance_correct(on); }
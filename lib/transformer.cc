@@ -16,6 +16,8 @@
 
 #include <assert.h>
 
+#include <algorithm>
+
 #include "transformer.h"
 
 namespace rgb_matrix {
@@ -35,8 +37,14 @@ public:
   virtual void SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue);
   virtual void Clear();
   virtual void Fill(uint8_t red, uint8_t green, uint8_t blue);
+  virtual void FillRect(int x, int y, int width, int height,
+                        uint8_t red, uint8_t green, uint8_t blue);
+  virtual void CopyRect(int x, int y, int width, int height,
+                        const uint8_t *rgb, int stride);
 
 private:
+  void Rotate(int *x, int *y) const;
+
   Canvas *delegatee_;
   int angle_;
   float pivot_x_;
@@ -58,21 +66,51 @@ void RotateTransformer::TransformCanvas::SetDelegatee(Canvas* delegatee) {
   delegatee_ = delegatee;
 }
 
-void RotateTransformer::TransformCanvas::SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue) {
+void RotateTransformer::TransformCanvas::Rotate(int *x, int *y) const {
   // translate point to origin
-  x -= pivot_x_;
-  y -= pivot_y_;
+  *x -= pivot_x_;
+  *y -= pivot_y_;
 
-  float rot_x = x * cos_ - y * sin_;
-  float rot_y = x * sin_ + y * cos_;
+  float rot_x = *x * cos_ - *y * sin_;
+  float rot_y = *x * sin_ + *y * cos_;
 
   // translate back
-  x = rot_x + pivot_x_ + offset_x_;
-  y = rot_y + pivot_y_ + offset_y_;
+  *x = rot_x + pivot_x_ + offset_x_;
+  *y = rot_y + pivot_y_ + offset_y_;
+}
 
+void RotateTransformer::TransformCanvas::SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue) {
+  Rotate(&x, &y);
   delegatee_->SetPixel(x, y, red, green, blue);
 }
 
+void RotateTransformer::TransformCanvas::FillRect(int x, int y, int w, int h,
+                                                  uint8_t red, uint8_t green,
+                                                  uint8_t blue) {
+  if (x < 0) { w += x; x = 0; }
+  if (y < 0) { h += y; y = 0; }
+  if (x + w > width()) w = width() - x;
+  if (y + h > height()) h = height() - y;
+  if (w <= 0 || h <= 0) return;
+  // A rotated rectangle is still a rectangle: just map the corners.
+  int x0 = x, y0 = y, x1 = x + w - 1, y1 = y + h - 1;
+  Rotate(&x0, &y0);
+  Rotate(&x1, &y1);
+  if (x1 < x0) std::swap(x0, x1);
+  if (y1 < y0) std::swap(y0, y1);
+  delegatee_->FillRect(x0, y0, x1 - x0 + 1, y1 - y0 + 1, red, green, blue);
+}
+
+void RotateTransformer::TransformCanvas::CopyRect(int x, int y, int w, int h,
+                                                  const uint8_t *rgb,
+                                                  int stride) {
+  if (angle_ == 0) {
+    delegatee_->CopyRect(x, y, w, h, rgb, stride);
+  } else {
+    Canvas::CopyRect(x, y, w, h, rgb, stride);  // Pixel by pixel.
+  }
+}
+
 int RotateTransformer::TransformCanvas::width() const { 
   return (angle_ % 180 == 0) ? delegatee_->width() : delegatee_->height();
 }
@@ -167,6 +205,10 @@ public:
   virtual int width() const;
   virtual int height() const;
   virtual void SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue);
+  virtual void FillRect(int x, int y, int width, int height,
+                        uint8_t red, uint8_t green, uint8_t blue);
+  virtual void CopyRect(int x, int y, int width, int height,
+                        const uint8_t *rgb, int stride);
 
 private:
   Canvas *delegatee_;
@@ -206,6 +248,42 @@ void LargeSquare64x64Transformer::TransformCanvas::SetPixel(int x, int y, uint8_
   delegatee_->SetPixel(x, y, red, green, blue);
 }
 
+void LargeSquare64x64Transformer::TransformCanvas::FillRect(
+  int x, int y, int w, int h, uint8_t red, uint8_t green, uint8_t blue) {
+  if (x < 0) { w += x; x = 0; }
+  if (y < 0) { h += y; y = 0; }
+  if (x + w > width()) w = width() - x;
+  if (y + h > height()) h = height() - y;
+  if (w <= 0 || h <= 0) return;
+  const int top_h = (y < 32) ? std::min(h, 32 - y) : 0;
+  if (top_h > 0) {
+    delegatee_->FillRect(x, y, w, top_h, red, green, blue);
+  }
+  if (top_h < h) {  // Folded part: mirrored in both directions.
+    delegatee_->FillRect(128 - x - w, 64 - y - h, w, h - top_h,
+                         red, green, blue);
+  }
+}
+
+void LargeSquare64x64Transformer::TransformCanvas::CopyRect(
+  int x, int y, int w, int h, const uint8_t *rgb, int stride) {
+  if (y < 0) { rgb -= stride * y; h += y; y = 0; }
+  const int top_h = (y < 32) ? std::min(h, 32 - y) : 0;
+  if (top_h > 0) {
+    // The upper half is not transformed; clip to it.
+    int top_x = x, top_w = w;
+    const uint8_t *top_rgb = rgb;
+    if (top_x < 0) { top_rgb -= 3 * top_x; top_w += top_x; top_x = 0; }
+    if (top_x + top_w > width()) top_w = width() - top_x;
+    if (top_w > 0) {
+      delegatee_->CopyRect(top_x, y, top_w, top_h, top_rgb, stride);
+    }
+  }
+  if (top_h < h) {  // Folded part is mirrored: pixel by pixel.
+    Canvas::CopyRect(x, y + top_h, w, h - top_h, rgb + top_h * stride, stride);
+  }
+}
+
 /****************************/
 /* Large Square Transformer */
 /****************************/
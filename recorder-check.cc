@@ -0,0 +1,421 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Checks the output of the library without a Raspberry Pi: draws test
+// images, records what would be sent to the GPIO pins and decodes it again
+// as the panels would see it. Run it after changes to the output code:
+//   make check
+//
+// This code is public domain
+// (but note, that the led-matrix library this depends on is GPL v2)
+
+#include "led-matrix.h"
+#include "frame-archive.h"
+#include "gpio-recorder.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+
+using rgb_matrix::FrameArchive;
+using rgb_matrix::FrameArchiveWriter;
+using rgb_matrix::FrameCanvas;
+using rgb_matrix::GPIO;
+using rgb_matrix::GPIORecorder;
+using rgb_matrix::Hub75Decoder;
+using rgb_matrix::RGBMatrix;
+
+struct Config {
+  int rows, chain, parallel;
+  int pwm_bits;
+  int dither_bits;
+  int subframes;
+  bool compile_frames;
+  bool auto_pwm_bits;
+  bool bulk_upload;   // SetPixels() instead of SetPixel()
+  uint8_t color_mask; // Colors only using these bits.
+};
+
+static const Config kConfigs[] = {
+  { 32, 1, 1, 11, 0,  1, false, false, false, 0xff },
+  { 32, 2, 2, 11, 0,  1, true,  false, true,  0xff },
+  { 16, 1, 3,  7, 0,  1, false, false, true,  0xff },
+  {  8, 3, 1,  4, 0,  1, true,  false, false, 0xff },
+  { 32, 1, 3,  1, 0,  1, false, false, false, 0xff },
+  { 32, 2, 2, 11, 0,  4, false, false, false, 0xff },
+  { 16, 1, 1,  7, 0, 16, true,  false, true,  0xff },
+  { 32, 2, 1, 11, 0,  1, false, true,  false, 0xe0 },
+  { 32, 1, 3, 11, 0,  8, true,  true,  true,  0xc0 },
+  { 32, 1, 1,  7, 4,  1, false, false, false, 0xff },
+  { 16, 1, 1,  6, 5,  1, false, false, true,  0xff },
+};
+
+// The color the panels show for "value": without luminance correction,
+// the 8 bits of the value are the upper of 11 bits, of which the upper
+// "pwm_bits" are shown; with dither bits, that many more in the average
+// over 2^dither_bits frames. With auto PWM bits, not those below the
+// lowest bit used in the image.
+static int Expected(uint8_t value, const Config &c) {
+  int mask = (0x7ff << (11 - c.pwm_bits - c.dither_bits)) & 0x7ff;
+  if (c.auto_pwm_bits) {
+    const int used = c.color_mask << 3;
+    mask &= ~((used & -used) - 1);
+  }
+  return (255 * ((value << 3) & mask) + mask / 2) / mask;
+}
+
+static void RandomImage(int width, int height, uint8_t color_mask,
+                        std::vector<uint8_t> *image) {
+  image->resize(width * height * 3);
+  for (size_t i = 0; i < image->size(); ++i) {
+    switch (rand() % 4) {
+    case 0: (*image)[i] = 0; break;
+    case 1: (*image)[i] = 255; break;
+    default: (*image)[i] = rand(); break;
+    }
+    (*image)[i] &= color_mask;
+  }
+}
+
+static void Draw(FrameCanvas *canvas, const std::vector<uint8_t> &image) {
+  canvas->SetPixels(0, 0, canvas->width(), canvas->height(), &image[0],
+                    canvas->width() * 3);
+}
+
+// Show "canvas" (NULL: keep the active one) and decode what the panels see,
+// at most "max_frames" frames (0: all recorded).
+static void ShowAndDecode(RGBMatrix *matrix, FrameCanvas *canvas,
+                          GPIORecorder *recorder, Hub75Decoder *decoder,
+                          int max_frames = 0) {
+  matrix->SwapOnVSync(canvas);
+  matrix->SwapOnVSync(NULL);  // Make sure it has been shown fully.
+  recorder->Reset();
+  while (!recorder->full()) usleep(1000);
+  std::vector<GPIORecorder::Event> events;
+  recorder->GetEvents(&events);
+  decoder->Replay(events, max_frames);
+}
+
+// Both showed exactly the same: the LEDs were on for the same time in
+// each frame. Differences in the bitplanes show up as differences here.
+static bool SameContent(const Hub75Decoder &a, const Hub75Decoder &b) {
+  if (a.frames() == 0 || b.frames() == 0) return false;
+  for (int y = 0; y < a.height(); ++y) {
+    for (int x = 0; x < a.width(); ++x) {
+      for (int c = 0; c < 3; ++c) {
+        if (a.OnNanos(x, y, c) * b.frames() != b.OnNanos(x, y, c) * a.frames())
+          return false;
+      }
+    }
+  }
+  return true;
+}
+
+static bool Check(const Config &c, GPIO *io, GPIORecorder *recorder) {
+  RGBMatrix *matrix = new RGBMatrix(io, c.rows, c.chain, c.parallel);
+  matrix->set_luminance_correct(false);
+  matrix->SetPWMBits(c.pwm_bits);
+  matrix->SetDitherBits(c.dither_bits);
+  matrix->SetSubframes(c.subframes);
+  matrix->set_compile_frames(c.compile_frames);
+  matrix->set_auto_pwm_bits(c.auto_pwm_bits);
+
+  FrameCanvas *canvas = matrix->CreateFrameCanvas();
+  const int width = canvas->width();
+  const int height = canvas->height();
+  std::vector<uint8_t> image;
+  RandomImage(width, height, c.color_mask, &image);
+  if (c.bulk_upload) {
+    canvas->SetPixels(0, 0, width, height, &image[0], width * 3);
+  } else {
+    for (int y = 0; y < height; ++y) {
+      for (int x = 0; x < width; ++x) {
+        const uint8_t *rgb = &image[(y * width + x) * 3];
+        canvas->SetPixel(x, y, rgb[0], rgb[1], rgb[2]);
+      }
+    }
+  }
+  // With dither bits, exactly one turn through them.
+  const int frames = c.dither_bits > 0 ? 1 << c.dither_bits : 0;
+  Hub75Decoder decoder(c.rows, c.chain, c.parallel, c.subframes);
+  ShowAndDecode(matrix, canvas, recorder, &decoder, frames);
+  delete matrix;
+
+  int errors = 0;
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      uint8_t shown[3];
+      decoder.GetPixel(x, y, &shown[0], &shown[1], &shown[2]);
+      for (int i = 0; i < 3; ++i) {
+        const int want = Expected(image[(y * width + x) * 3 + i], c);
+        if (abs(shown[i] - want) > 1 && errors++ < 3) {
+          fprintf(stderr, "  (%d,%d)[%d]: shows %d, expected %d\n",
+                  x, y, i, shown[i], want);
+        }
+      }
+    }
+  }
+  const bool ok = (errors == 0 && decoder.frames() > 0
+                   && (frames == 0 || decoder.frames() == frames));
+  printf("rows=%d chain=%d parallel=%d pwm=%d dither=%d subframes=%d "
+         "compile=%d auto-pwm=%d bulk=%d: %d frames, %.0fHz, %s\n",
+         c.rows, c.chain, c.parallel, c.pwm_bits, c.dither_bits, c.subframes,
+         c.compile_frames, c.auto_pwm_bits, c.bulk_upload,
+         decoder.frames(), 1e9 / decoder.frame_nanos(), ok ? "OK" : "FAIL");
+  return ok;
+}
+
+// Canvases only go back to the pool of the matrix that created them.
+static bool CheckRelease(GPIO *io) {
+  RGBMatrix *matrix = new RGBMatrix(io, 16, 1, 1);
+  RGBMatrix *other = new RGBMatrix(NULL, 16, 1, 1);  // No second refresh.
+  FrameCanvas *const mine = matrix->CreateFrameCanvas();
+  FrameCanvas *const foreign = other->CreateFrameCanvas();
+  const bool ok = (!matrix->ReleaseFrameCanvas(foreign)
+                   && matrix->ReleaseFrameCanvas(mine)
+                   && !matrix->ReleaseFrameCanvas(mine)
+                   && !matrix->ReleaseFrameCanvas(matrix->SwapOnVSync(NULL))
+                   && matrix->AcquireFrameCanvas() == mine
+                   // Without GPIO, swapping doesn't wait for anything.
+                   && other->SwapOnVSync(foreign) != foreign
+                   && other->SwapOnVSync(NULL) == foreign);
+  delete other;
+  delete matrix;
+  printf("release frame canvases: %s\n", ok ? "OK" : "FAIL");
+  return ok;
+}
+
+// The output brightness scales the time the LEDs are on. Colors only use
+// bits whose pulses are long enough to be scaled exactly.
+static bool CheckOutputBrightness(GPIO *io, GPIORecorder *recorder) {
+  static const int kPercent[] = { 50, 25 };
+  RGBMatrix *matrix = new RGBMatrix(io, 16, 2, 1);
+  matrix->set_luminance_correct(false);
+  FrameCanvas *const canvas = matrix->CreateFrameCanvas();
+  std::vector<uint8_t> image;
+  RandomImage(canvas->width(), canvas->height(), 0xff, &image);
+  Draw(canvas, image);
+  Hub75Decoder full(16, 2, 1);
+  ShowAndDecode(matrix, canvas, recorder, &full);
+  bool ok = full.frames() > 0;
+  for (size_t i = 0; ok && i < sizeof(kPercent) / sizeof(kPercent[0]); ++i) {
+    matrix->SetOutputBrightness(kPercent[i]);
+    Hub75Decoder dimmed(16, 2, 1);
+    ShowAndDecode(matrix, NULL, recorder, &dimmed);
+    ok = dimmed.frames() > 0;
+    for (int y = 0; ok && y < full.height(); ++y) {
+      for (int x = 0; ok && x < full.width(); ++x) {
+        for (int c = 0; c < 3; ++c) {
+          ok = ok && (dimmed.OnNanos(x, y, c) * full.frames() * 100
+                      == (full.OnNanos(x, y, c) * dimmed.frames()
+                          * kPercent[i]));
+        }
+      }
+    }
+  }
+  matrix->SetOutputBrightness(100);
+  delete matrix;
+  printf("output brightness: %s\n", ok ? "OK" : "FAIL");
+  return ok;
+}
+
+// With a shadow buffer, GetPixel() returns what was drawn, and changing the
+// PWM bits, brightness or luminance correction re-encodes the content as
+// if it was drawn with these settings.
+static bool CheckShadowBuffer(GPIO *io, GPIORecorder *recorder) {
+  RGBMatrix *matrix = new RGBMatrix(io, 16, 2, 1);
+  FrameCanvas *const shadowed = matrix->CreateFrameCanvas();
+  FrameCanvas *const direct = matrix->CreateFrameCanvas();
+  shadowed->SetShadowBuffer(true);
+  std::vector<uint8_t> image;
+  RandomImage(shadowed->width(), shadowed->height(), 0xff, &image);
+  Draw(shadowed, image);
+  bool ok = true;
+  for (int y = 0; y < shadowed->height(); ++y) {
+    for (int x = 0; x < shadowed->width(); ++x) {
+      uint8_t rgb[3];
+      ok = ok && shadowed->GetPixel(x, y, &rgb[0], &rgb[1], &rgb[2])
+        && memcmp(rgb, &image[(y * shadowed->width() + x) * 3], 3) == 0;
+    }
+  }
+
+  shadowed->SetPWMBits(8);
+  shadowed->SetBrightness(40);
+  shadowed->set_luminance_correct(false);
+  direct->SetPWMBits(8);
+  direct->SetBrightness(40);
+  direct->set_luminance_correct(false);
+  Draw(direct, image);
+  Hub75Decoder reencoded(16, 2, 1), drawn(16, 2, 1);
+  ShowAndDecode(matrix, shadowed, recorder, &reencoded);
+  ShowAndDecode(matrix, direct, recorder, &drawn);
+  ok = ok && SameContent(reencoded, drawn);
+  delete matrix;
+  printf("shadow buffer: %s\n", ok ? "OK" : "FAIL");
+  return ok;
+}
+
+// CopyFrom() a rectangle shows the same as drawing it. A copy of a whole
+// frame shows the same as the original, also after re-encoding both.
+static bool CheckCopyFrom(GPIO *io, GPIORecorder *recorder) {
+  RGBMatrix *matrix = new RGBMatrix(io, 16, 2, 1);
+  FrameCanvas *const from = matrix->CreateFrameCanvas();
+  FrameCanvas *const to = matrix->CreateFrameCanvas();
+  FrameCanvas *const direct = matrix->CreateFrameCanvas();
+  const int width = from->width();
+  std::vector<uint8_t> image, background;
+  RandomImage(width, from->height(), 0xff, &image);
+  RandomImage(width, from->height(), 0xff, &background);
+  Draw(from, image);
+  Draw(to, background);
+  Draw(direct, background);
+  // Only parts of double rows and of batches of columns.
+  const int x = 3, y = 5, w = 37, h = 9;
+  to->CopyFrom(*from, x, y, w, h);
+  direct->SetPixels(x, y, w, h, &image[(y * width + x) * 3], width * 3);
+  Hub75Decoder copied(16, 2, 1), drawn(16, 2, 1);
+  ShowAndDecode(matrix, to, recorder, &copied);
+  ShowAndDecode(matrix, direct, recorder, &drawn);
+  bool ok = SameContent(copied, drawn);
+  printf("copy rectangle: %s\n", ok ? "OK" : "FAIL");
+
+  from->SetShadowBuffer(true);
+  to->SetShadowBuffer(true);
+  from->SetPWMBits(7);
+  from->SetBrightness(60);
+  Draw(from, image);
+  to->SetBrightness(20);
+  to->CopyFrom(*from);
+  // Re-encoded with the brightness the content was drawn with.
+  from->set_luminance_correct(false);
+  to->set_luminance_correct(false);
+  Hub75Decoder original(16, 2, 1), copy(16, 2, 1);
+  ShowAndDecode(matrix, from, recorder, &original);
+  ShowAndDecode(matrix, to, recorder, &copy);
+  const bool same = to->pwmbits() == 7 && SameContent(original, copy);
+  printf("copy frame: %s\n", same ? "OK" : "FAIL");
+  delete matrix;
+  return ok && same;
+}
+
+// Byte offsets of uint32_t fields in the archive header, see
+// lib/frame-archive.cc.
+enum {
+  kVersionField = 8,
+  kPWMBitsField = 28,
+  kFrameStrideField = 40,
+  kFramesOffsetField = 44,
+  kDitherBitsField = 52,
+};
+
+static bool ReadFile(const char *filename, std::vector<char> *data) {
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) return false;
+  char buffer[4096];
+  size_t r;
+  data->clear();
+  while ((r = fread(buffer, 1, sizeof(buffer), f)) > 0)
+    data->insert(data->end(), buffer, buffer + r);
+  fclose(f);
+  return true;
+}
+
+static bool WriteFile(const char *filename, const std::vector<char> &data) {
+  FILE *f = fopen(filename, "wb");
+  if (f == NULL) return false;
+  const bool success = fwrite(&data[0], 1, data.size(), f) == data.size();
+  return fclose(f) == 0 && success;
+}
+
+// Archived frames show the same as the frames written; archives with broken
+// headers are rejected.
+static bool CheckArchive(GPIO *io, GPIORecorder *recorder) {
+  static const uint32_t kDelays[] = { 100000, 20000, 3000 };
+  static const int kFrames = sizeof(kDelays) / sizeof(kDelays[0]);
+  RGBMatrix *matrix = new RGBMatrix(io, 16, 2, 1);
+  matrix->SetPWMBits(9);
+  char filename[] = "/tmp/recorder-check-XXXXXX";
+  close(mkstemp(filename));
+
+  FrameArchiveWriter writer;
+  bool ok = writer.Open(filename);
+  std::vector<FrameCanvas*> frames;
+  for (int i = 0; i < kFrames; ++i) {
+    FrameCanvas *const frame = matrix->CreateFrameCanvas();
+    std::vector<uint8_t> image;
+    RandomImage(frame->width(), frame->height(), 0xff, &image);
+    Draw(frame, image);
+    ok = writer.AppendFrame(frame, kDelays[i]) && ok;
+    frames.push_back(frame);
+  }
+  ok = writer.Close() && ok;
+
+  FrameArchive archive;
+  ok = ok && archive.Open(filename, frames[0]) && archive.frames() == kFrames;
+  for (int i = 0; ok && i < kFrames; ++i) {
+    Hub75Decoder written(16, 2, 1), archived(16, 2, 1);
+    ShowAndDecode(matrix, frames[i], recorder, &written);
+    ShowAndDecode(matrix, archive.frame(i), recorder, &archived);
+    ok = archive.delay_usec(i) == kDelays[i] && SameContent(written, archived);
+  }
+  printf("archive round trip: %s\n", ok ? "OK" : "FAIL");
+
+  std::vector<char> good;
+  ok = ReadFile(filename, &good) && good.size() > 64;
+  uint32_t stride = 0;
+  if (ok) memcpy(&stride, &good[kFrameStrideField], sizeof(stride));
+  const struct { int field; uint32_t value; } kBroken[] = {
+    { kVersionField, 1 },
+    { kPWMBitsField, 0 },
+    { kPWMBitsField, 12 },
+    { kPWMBitsField, 256 + 9 },      // Same as 9 in an uint8_t.
+    { kDitherBitsField, 3 },         // With 9 PWM bits.
+    { kFramesOffsetField, 2048 },    // Within the header page.
+    { kFrameStrideField, stride - 1 },
+  };
+  char broken_name[] = "/tmp/recorder-check-XXXXXX";
+  close(mkstemp(broken_name));
+  int accepted = 0;
+  for (size_t i = 0; ok && i < sizeof(kBroken) / sizeof(kBroken[0]); ++i) {
+    std::vector<char> broken(good);
+    memcpy(&broken[kBroken[i].field], &kBroken[i].value, sizeof(uint32_t));
+    FrameArchive a;
+    if (!WriteFile(broken_name, broken) || a.Open(broken_name, frames[0]))
+      ++accepted;
+  }
+  std::vector<char> truncated(good.begin(), good.end() - 1);
+  FrameArchive a;
+  if (ok && (!WriteFile(broken_name, truncated)
+             || a.Open(broken_name, frames[0])))
+    ++accepted;
+  const bool rejected = ok && accepted == 0;
+  printf("archive broken headers: %s\n", rejected ? "OK" : "FAIL");
+
+  delete matrix;  // Before the archive with the active frame goes away.
+  unlink(filename);
+  unlink(broken_name);
+  return ok && rejected;
+}
+
+int main() {
+  // The mapping that supports all parallel chains.
+  RGBMatrix::SetHardwareMapping("regular");
+  // The output enable pulser is set up once with the first GPIO, so all
+  // checks share it.
+  GPIORecorder recorder(400000);
+  GPIO io;
+  io.Init(&recorder);
+  srand(42);
+  int failures = 0;
+  for (size_t i = 0; i < sizeof(kConfigs) / sizeof(kConfigs[0]); ++i) {
+    if (!Check(kConfigs[i], &io, &recorder)) ++failures;
+  }
+  if (!CheckRelease(&io)) ++failures;
+  if (!CheckOutputBrightness(&io, &recorder)) ++failures;
+  if (!CheckShadowBuffer(&io, &recorder)) ++failures;
+  if (!CheckCopyFrom(&io, &recorder)) ++failures;
+  if (!CheckArchive(&io, &recorder)) ++failures;
+  return failures == 0 ? 0 : 1;
+}